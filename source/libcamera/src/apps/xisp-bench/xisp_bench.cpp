@@ -0,0 +1,740 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2025 - Mario Bergeron <Mario.Bergeron@avnet.com>
+ *
+ * xisp-bench - Benchmark the xisp pipeline handler
+ *
+ * Captures a single processed stream for every combination of pixel format,
+ * size and buffer count, and reports the sustained frame rate, the latency
+ * from queueRequest() to request completion, the dropped frames and the CPU
+ * time spent per frame in the libcamera thread, as JSON.
+ *
+ * A secondary stream can be captured along with every Nth frame only, to
+ * exercise requests that don't carry a buffer for all the streams. Requests
+ * whose buffers report different frames are counted as split.
+ *
+ * The cost of filling the metadata of a completed request can also be
+ * measured without a camera, comparing a fill per buffer to the single fill
+ * per request of the handler, for one to four streams.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <errno.h>
+#include <fstream>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+using namespace libcamera;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+	std::string camera;
+	std::vector<PixelFormat> formats;
+	std::vector<Size> sizes = {
+		{ 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 },
+	};
+	std::vector<unsigned int> bufferCounts = { 2, 4, 6 };
+	unsigned int frames = 300;
+	unsigned int warmup = 30;
+	/* Frames per secondary stream buffer, 0 to disable the stream. */
+	unsigned int secondaryInterval = 0;
+	Size secondarySize = { 640, 480 };
+	/* Requests of the metadata cost benchmark, 0 to capture frames. */
+	unsigned int metadataRequests = 0;
+	std::string output;
+};
+
+struct MetadataCost {
+	unsigned int streams = 0;
+	/* Metadata fill cost per request, in nanoseconds. */
+	double perBuffer = 0.0;
+	double perRequest = 0.0;
+};
+
+struct Result {
+	PixelFormat format;
+	Size size;
+	unsigned int bufferCount = 0;
+	std::string status;
+
+	unsigned int frames = 0;
+	unsigned int dropped = 0;
+	unsigned int errors = 0;
+	unsigned int secondaryFrames = 0;
+	unsigned int splitRequests = 0;
+	double fps = 0.0;
+	/* Queue to completion latency percentiles, in microseconds. */
+	double p50 = 0.0;
+	double p99 = 0.0;
+	double p999 = 0.0;
+	/* CPU time of the libcamera thread per frame, in microseconds. */
+	double cpuPerFrame = 0.0;
+};
+
+/* CPU time consumed by the calling thread. */
+std::chrono::nanoseconds threadCpuTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+
+	size_t index = std::min(sorted.size() - 1,
+				static_cast<size_t>(p * sorted.size()));
+	return sorted[index] / 1000.0;
+}
+
+std::string jsonString(const std::string &str)
+{
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"' || c == '\\')
+			out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+/*
+ * Fill the metadata of a request as the handler does on completion, from the
+ * frame metadata of its buffers. With perBuffer set, the metadata is updated
+ * as each buffer completes, with a lookup to keep the first timestamp,
+ * otherwise it is filled once from the earliest buffer.
+ */
+void fillMetadata(ControlList *metadata, const std::vector<FrameMetadata> &frames,
+		  bool perBuffer)
+{
+	const FrameMetadata *frame = nullptr;
+
+	for (const FrameMetadata &info : frames) {
+		if (!frame || info.timestamp < frame->timestamp)
+			frame = &info;
+
+		if (!perBuffer)
+			continue;
+
+		if (!metadata->contains(controls::SensorTimestamp.id()))
+			metadata->set(controls::SensorTimestamp, info.timestamp);
+		metadata->set(controls::FrameDuration, 16666);
+		metadata->set(controls::ExposureTime, 10000);
+		metadata->set(controls::AnalogueGain, 2.0f);
+		metadata->set(controls::ColourGains, { 1.5f, 1.8f });
+		metadata->set(controls::ScalerCrop, Rectangle(0, 0, 1920, 1080));
+	}
+
+	if (perBuffer || !frame)
+		return;
+
+	metadata->set(controls::SensorTimestamp, frame->timestamp);
+	metadata->set(controls::FrameDuration, 16666);
+	metadata->set(controls::ExposureTime, 10000);
+	metadata->set(controls::AnalogueGain, 2.0f);
+	metadata->set(controls::ColourGains, { 1.5f, 1.8f });
+	metadata->set(controls::ScalerCrop, Rectangle(0, 0, 1920, 1080));
+}
+
+double metadataCost(unsigned int streams, unsigned int requests, bool perBuffer)
+{
+	std::vector<FrameMetadata> frames(streams);
+	ControlList metadata(controls::controls);
+
+	Clock::time_point begin = Clock::now();
+
+	for (unsigned int i = 0; i < requests; i++) {
+		for (unsigned int j = 0; j < streams; j++) {
+			frames[j].status = FrameMetadata::FrameSuccess;
+			frames[j].sequence = i;
+			frames[j].timestamp = (i + 1) * 16666000ULL + j;
+		}
+
+		/* Requests are reused with their metadata cleared. */
+		metadata.clear();
+		fillMetadata(&metadata, frames, perBuffer);
+	}
+
+	std::chrono::duration<double, std::nano> elapsed = Clock::now() - begin;
+	return elapsed.count() / requests;
+}
+
+void writeMetadataJson(std::ostream &out, const std::vector<MetadataCost> &costs)
+{
+	out << std::fixed << std::setprecision(3);
+	out << "{\n"
+	    << "  \"libcamera\": " << jsonString(CameraManager::version()) << ",\n"
+	    << "  \"metadataCost\": [";
+
+	for (size_t i = 0; i < costs.size(); i++) {
+		const MetadataCost &cost = costs[i];
+
+		out << (i ? "," : "") << "\n    {\n"
+		    << "      \"streams\": " << cost.streams << ",\n"
+		    << "      \"perBufferNs\": " << cost.perBuffer << ",\n"
+		    << "      \"perRequestNs\": " << cost.perRequest << "\n"
+		    << "    }";
+	}
+
+	out << "\n  ]\n}\n";
+}
+
+class Benchmark
+{
+public:
+	Benchmark(std::shared_ptr<Camera> camera, const Options &options)
+		: camera_(std::move(camera)), options_(options)
+	{
+	}
+
+	void run(Result *result);
+
+private:
+	void queueRequest(Request *request);
+	void requestComplete(Request *request);
+
+	std::shared_ptr<Camera> camera_;
+	const Options &options_;
+	Stream *stream_ = nullptr;
+	Stream *secondary_ = nullptr;
+
+	std::mutex mutex_;
+	std::condition_variable done_;
+	bool running_ = false;
+
+	/* Secondary buffers not attached to a queued request. */
+	std::vector<FrameBuffer *> freeSecondary_;
+	unsigned int queued_ = 0;
+
+	std::vector<Clock::time_point> queueTimes_;
+	std::vector<uint64_t> latencies_;
+	unsigned int completed_ = 0;
+	unsigned int dropped_ = 0;
+	unsigned int errors_ = 0;
+	unsigned int secondaryFrames_ = 0;
+	unsigned int splitRequests_ = 0;
+	std::optional<uint32_t> lastSequence_;
+	std::optional<int64_t> lastTimestamp_;
+
+	Clock::time_point begin_;
+	Clock::time_point end_;
+	std::chrono::nanoseconds cpuBegin_;
+	std::chrono::nanoseconds cpuEnd_;
+};
+
+void Benchmark::run(Result *result)
+{
+	std::vector<StreamRole> roles = { StreamRole::VideoRecording };
+	if (options_.secondaryInterval)
+		roles.push_back(StreamRole::Viewfinder);
+
+	/* Cameras with a single processed pipe can't capture a secondary stream. */
+	std::unique_ptr<CameraConfiguration> config = camera_->generateConfiguration(roles);
+	if (!config || config->size() != roles.size()) {
+		result->status = options_.secondaryInterval ? "unsupported" : "failed";
+		return;
+	}
+
+	StreamConfiguration &cfg = config->at(0);
+	cfg.pixelFormat = result->format;
+	cfg.size = result->size;
+	cfg.bufferCount = result->bufferCount;
+
+	if (options_.secondaryInterval) {
+		StreamConfiguration &secondary = config->at(1);
+		secondary.size = options_.secondarySize;
+		secondary.bufferCount = result->bufferCount;
+	}
+
+	/*
+	 * The buffer count may be clamped to the CMA budget, report the one
+	 * actually used. Other adjustments make the combination unsupported.
+	 */
+	if (config->validate() == CameraConfiguration::Invalid ||
+	    cfg.pixelFormat != result->format || cfg.size != result->size) {
+		result->status = "unsupported";
+		return;
+	}
+
+	result->bufferCount = cfg.bufferCount;
+
+	if (camera_->configure(config.get()) < 0) {
+		result->status = "failed";
+		return;
+	}
+
+	stream_ = cfg.stream();
+	secondary_ = options_.secondaryInterval ? config->at(1).stream() : nullptr;
+
+	FrameBufferAllocator allocator(camera_);
+	if (allocator.allocate(stream_) < 0 ||
+	    (secondary_ && allocator.allocate(secondary_) < 0)) {
+		result->status = "failed";
+		return;
+	}
+
+	std::vector<std::unique_ptr<Request>> requests;
+	for (const std::unique_ptr<FrameBuffer> &buffer : allocator.buffers(stream_)) {
+		unsigned int index = requests.size();
+		std::unique_ptr<Request> request = camera_->createRequest(index);
+		if (!request || request->addBuffer(stream_, buffer.get()) < 0) {
+			result->status = "failed";
+			return;
+		}
+
+		requests.push_back(std::move(request));
+	}
+
+	freeSecondary_.clear();
+	if (secondary_) {
+		for (const std::unique_ptr<FrameBuffer> &buffer : allocator.buffers(secondary_))
+			freeSecondary_.push_back(buffer.get());
+	}
+	queued_ = 0;
+
+	queueTimes_.assign(requests.size(), {});
+	latencies_.clear();
+	latencies_.reserve(options_.frames);
+	completed_ = 0;
+	dropped_ = 0;
+	errors_ = 0;
+	secondaryFrames_ = 0;
+	splitRequests_ = 0;
+	lastSequence_.reset();
+	lastTimestamp_.reset();
+	running_ = true;
+
+	camera_->requestCompleted.connect(this, &Benchmark::requestComplete);
+
+	if (camera_->start() < 0) {
+		camera_->requestCompleted.disconnect(this);
+		result->status = "failed";
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> locker(mutex_);
+
+		for (std::unique_ptr<Request> &request : requests)
+			queueRequest(request.get());
+
+		/* Allow one second per frame at worst, for stalled pipelines. */
+		auto timeout = std::chrono::seconds(options_.warmup + options_.frames);
+		if (!done_.wait_for(locker, timeout, [this] { return !running_; })) {
+			running_ = false;
+			result->status = "timeout";
+		}
+	}
+
+	camera_->stop();
+	camera_->requestCompleted.disconnect(this);
+
+	if (result->status.empty())
+		result->status = "ok";
+
+	std::sort(latencies_.begin(), latencies_.end());
+
+	unsigned int measured = latencies_.size();
+
+	result->frames = measured;
+	result->dropped = dropped_;
+	result->errors = errors_;
+	result->secondaryFrames = secondaryFrames_;
+	result->splitRequests = splitRequests_;
+	result->p50 = percentile(latencies_, 0.5);
+	result->p99 = percentile(latencies_, 0.99);
+	result->p999 = percentile(latencies_, 0.999);
+
+	/* The measurement window is only closed when all frames completed. */
+	if (result->status != "ok" || measured < 2)
+		return;
+
+	double elapsed = std::chrono::duration<double>(end_ - begin_).count();
+	if (elapsed > 0.0)
+		result->fps = (measured - 1) / elapsed;
+	result->cpuPerFrame = std::chrono::duration<double, std::micro>(cpuEnd_ - cpuBegin_).count()
+			    / measured;
+}
+
+/* Runs in the libcamera thread, whose CPU time is measured here. */
+void Benchmark::requestComplete(Request *request)
+{
+	if (request->status() == Request::RequestCancelled)
+		return;
+
+	Clock::time_point now = Clock::now();
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (!running_)
+		return;
+
+	unsigned int index = request->cookie();
+	completed_++;
+
+	if (completed_ == options_.warmup + 1) {
+		begin_ = now;
+		cpuBegin_ = threadCpuTime();
+	}
+
+	if (completed_ > options_.warmup) {
+		uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - queueTimes_[index]).count();
+		latencies_.push_back(latency);
+
+		const FrameMetadata &metadata = request->findBuffer(stream_)->metadata();
+		if (metadata.status != FrameMetadata::FrameSuccess)
+			errors_++;
+
+		/*
+		 * Count the frame periods elapsed since the previous request,
+		 * and fall back to the gaps in the buffer sequence when the
+		 * frame duration isn't reported.
+		 */
+		const auto &timestamp = request->metadata().get(controls::SensorTimestamp);
+		const auto &duration = request->metadata().get(controls::FrameDuration);
+		if (lastTimestamp_ && timestamp && duration && *duration > 0) {
+			int64_t periods = std::llround((*timestamp - *lastTimestamp_) /
+						       (*duration * 1000.0));
+			if (periods > 1)
+				dropped_ += periods - 1;
+		} else if (lastSequence_ && metadata.sequence > *lastSequence_ + 1) {
+			dropped_ += metadata.sequence - *lastSequence_ - 1;
+		}
+
+		lastTimestamp_ = timestamp;
+		lastSequence_ = metadata.sequence;
+
+		/* Both buffers of a request are expected to hold the same frame. */
+		FrameBuffer *secondary = secondary_ ? request->findBuffer(secondary_) : nullptr;
+		if (secondary && secondary->metadata().status == FrameMetadata::FrameSuccess) {
+			secondaryFrames_++;
+			if (secondary->metadata().sequence != metadata.sequence)
+				splitRequests_++;
+		}
+	}
+
+	if (completed_ == options_.warmup + options_.frames) {
+		end_ = now;
+		cpuEnd_ = threadCpuTime();
+		running_ = false;
+		done_.notify_one();
+		return;
+	}
+
+	/* The secondary buffer goes back to the pool, for a later frame. */
+	FrameBuffer *buffer = request->findBuffer(stream_);
+	FrameBuffer *secondary = secondary_ ? request->findBuffer(secondary_) : nullptr;
+	if (secondary)
+		freeSecondary_.push_back(secondary);
+
+	request->reuse();
+	request->addBuffer(stream_, buffer);
+	queueRequest(request);
+}
+
+/*
+ * Queue a request, with a secondary buffer for every secondaryInterval-th
+ * frame. Called with mutex_ held.
+ */
+void Benchmark::queueRequest(Request *request)
+{
+	if (secondary_ && !(queued_ % options_.secondaryInterval) &&
+	    !freeSecondary_.empty()) {
+		if (request->addBuffer(secondary_, freeSecondary_.back()) == 0)
+			freeSecondary_.pop_back();
+	}
+
+	queued_++;
+	queueTimes_[request->cookie()] = Clock::now();
+	camera_->queueRequest(request);
+}
+
+template<typename T, typename F>
+bool parseList(const char *arg, std::vector<T> *list, F parse)
+{
+	std::stringstream ss(arg);
+	std::string item;
+
+	list->clear();
+	while (std::getline(ss, item, ',')) {
+		std::optional<T> value = parse(item);
+		if (!value)
+			return false;
+		list->push_back(*value);
+	}
+
+	return !list->empty();
+}
+
+std::optional<Size> parseSize(const std::string &str)
+{
+	unsigned int width, height;
+	char x;
+
+	std::stringstream ss(str);
+	if (!(ss >> width >> x >> height) || x != 'x')
+		return std::nullopt;
+
+	return Size(width, height);
+}
+
+void usage(const char *name)
+{
+	std::cerr
+		<< "Usage: " << name << " [options]\n"
+		<< "  -c, --camera <id|index>    Camera to benchmark, the first one by default\n"
+		<< "  -f, --formats <list>       Pixel formats, all the supported ones by default\n"
+		<< "  -s, --sizes <list>         Sizes, as WxH[,WxH...]\n"
+		<< "  -b, --buffers <list>       Buffer counts\n"
+		<< "  -n, --frames <count>       Frames measured per configuration\n"
+		<< "  -w, --warmup <count>       Frames ignored when starting the camera\n"
+		<< "  -i, --interval <count>     Capture a secondary stream every <count> frames\n"
+		<< "  -S, --secondary-size <WxH> Size of the secondary stream, 640x480 by default\n"
+		<< "  -m, --metadata <count>     Measure the metadata cost of <count> requests, no camera\n"
+		<< "  -o, --output <file>        JSON output file, stdout by default\n";
+}
+
+int parseOptions(int argc, char *argv[], Options *options)
+{
+	static const struct option longOptions[] = {
+		{ "camera", required_argument, nullptr, 'c' },
+		{ "formats", required_argument, nullptr, 'f' },
+		{ "sizes", required_argument, nullptr, 's' },
+		{ "buffers", required_argument, nullptr, 'b' },
+		{ "frames", required_argument, nullptr, 'n' },
+		{ "warmup", required_argument, nullptr, 'w' },
+		{ "interval", required_argument, nullptr, 'i' },
+		{ "secondary-size", required_argument, nullptr, 'S' },
+		{ "metadata", required_argument, nullptr, 'm' },
+		{ "output", required_argument, nullptr, 'o' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:f:s:b:n:w:i:S:m:o:h", longOptions, nullptr)) != -1) {
+		bool valid = true;
+
+		switch (opt) {
+		case 'c':
+			options->camera = optarg;
+			break;
+		case 'f':
+			valid = parseList(optarg, &options->formats,
+					  [](const std::string &str) -> std::optional<PixelFormat> {
+						  PixelFormat format = PixelFormat::fromString(str);
+						  if (!format.isValid())
+							  return std::nullopt;
+						  return format;
+					  });
+			break;
+		case 's':
+			valid = parseList(optarg, &options->sizes, parseSize);
+			break;
+		case 'b':
+			valid = parseList(optarg, &options->bufferCounts,
+					  [](const std::string &str) -> std::optional<unsigned int> {
+						  unsigned int count = strtoul(str.c_str(), nullptr, 10);
+						  if (!count)
+							  return std::nullopt;
+						  return count;
+					  });
+			break;
+		case 'n':
+			options->frames = strtoul(optarg, nullptr, 10);
+			valid = options->frames > 0;
+			break;
+		case 'w':
+			options->warmup = strtoul(optarg, nullptr, 10);
+			break;
+		case 'i':
+			options->secondaryInterval = strtoul(optarg, nullptr, 10);
+			valid = options->secondaryInterval > 0;
+			break;
+		case 'S': {
+			std::optional<Size> size = parseSize(optarg);
+			valid = size.has_value();
+			if (size)
+				options->secondarySize = *size;
+			break;
+		}
+		case 'm':
+			options->metadataRequests = strtoul(optarg, nullptr, 10);
+			valid = options->metadataRequests > 0;
+			break;
+		case 'o':
+			options->output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 1 : -EINVAL;
+		}
+
+		if (!valid) {
+			std::cerr << "Invalid argument for option -" << static_cast<char>(opt)
+				  << ": " << optarg << std::endl;
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+std::shared_ptr<Camera> findCamera(CameraManager &cm, const std::string &name)
+{
+	std::vector<std::shared_ptr<Camera>> cameras = cm.cameras();
+	if (cameras.empty())
+		return nullptr;
+
+	if (name.empty())
+		return cameras[0];
+
+	std::shared_ptr<Camera> camera = cm.get(name);
+	if (camera)
+		return camera;
+
+	char *end;
+	unsigned long index = strtoul(name.c_str(), &end, 10);
+	if (*end == '\0' && index < cameras.size())
+		return cameras[index];
+
+	return nullptr;
+}
+
+void writeJson(std::ostream &out, const Camera &camera,
+	       const std::vector<Result> &results)
+{
+	out << std::fixed << std::setprecision(3);
+	out << "{\n"
+	    << "  \"camera\": " << jsonString(camera.id()) << ",\n"
+	    << "  \"libcamera\": " << jsonString(CameraManager::version()) << ",\n"
+	    << "  \"results\": [";
+
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &result = results[i];
+
+		out << (i ? "," : "") << "\n    {\n"
+		    << "      \"format\": " << jsonString(result.format.toString()) << ",\n"
+		    << "      \"size\": " << jsonString(result.size.toString()) << ",\n"
+		    << "      \"bufferCount\": " << result.bufferCount << ",\n"
+		    << "      \"status\": " << jsonString(result.status) << ",\n"
+		    << "      \"frames\": " << result.frames << ",\n"
+		    << "      \"dropped\": " << result.dropped << ",\n"
+		    << "      \"errors\": " << result.errors << ",\n"
+		    << "      \"secondaryFrames\": " << result.secondaryFrames << ",\n"
+		    << "      \"splitRequests\": " << result.splitRequests << ",\n"
+		    << "      \"fps\": " << result.fps << ",\n"
+		    << "      \"latencyUs\": { \"p50\": " << result.p50
+		    << ", \"p99\": " << result.p99
+		    << ", \"p999\": " << result.p999 << " },\n"
+		    << "      \"cpuUsPerFrame\": " << result.cpuPerFrame << "\n"
+		    << "    }";
+	}
+
+	out << "\n  ]\n}\n";
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	int ret = parseOptions(argc, argv, &options);
+	if (ret)
+		return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (options.metadataRequests) {
+		std::vector<MetadataCost> costs;
+		for (unsigned int streams = 1; streams <= 4; streams++) {
+			MetadataCost cost;
+			cost.streams = streams;
+			cost.perBuffer = metadataCost(streams, options.metadataRequests, true);
+			cost.perRequest = metadataCost(streams, options.metadataRequests, false);
+			costs.push_back(cost);
+		}
+
+		if (options.output.empty()) {
+			writeMetadataJson(std::cout, costs);
+		} else {
+			std::ofstream file(options.output);
+			writeMetadataJson(file, costs);
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	CameraManager cm;
+	ret = cm.start();
+	if (ret) {
+		std::cerr << "Failed to start camera manager: " << ret << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::shared_ptr<Camera> camera = findCamera(cm, options.camera);
+	if (!camera || camera->acquire()) {
+		std::cerr << "Camera " << options.camera << " not available" << std::endl;
+		cm.stop();
+		return EXIT_FAILURE;
+	}
+
+	/* Sweep all the processed formats of the handler by default. */
+	if (options.formats.empty()) {
+		std::unique_ptr<CameraConfiguration> config =
+			camera->generateConfiguration({ StreamRole::VideoRecording });
+		if (config)
+			options.formats = config->at(0).formats().pixelformats();
+	}
+
+	std::vector<Result> results;
+	Benchmark benchmark(camera, options);
+
+	for (const PixelFormat &format : options.formats) {
+		for (const Size &size : options.sizes) {
+			for (unsigned int bufferCount : options.bufferCounts) {
+				Result result;
+				result.format = format;
+				result.size = size;
+				result.bufferCount = bufferCount;
+
+				std::cerr << format << " " << size << " x" << bufferCount
+					  << ": " << std::flush;
+				benchmark.run(&result);
+				std::cerr << result.status << " " << result.fps << " fps"
+					  << std::endl;
+
+				results.push_back(result);
+			}
+		}
+	}
+
+	if (options.output.empty()) {
+		writeJson(std::cout, *camera, results);
+	} else {
+		std::ofstream file(options.output);
+		writeJson(file, *camera, results);
+	}
+
+	camera->release();
+	camera.reset();
+	cm.stop();
+
+	return EXIT_SUCCESS;
+}
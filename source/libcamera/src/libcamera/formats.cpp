@@ -8,6 +8,8 @@
 #include "libcamera/internal/formats.h"
 
 #include <map>
+#include <string_view>
+#include <unordered_map>
 
 #include <libcamera/base/log.h>
 #include <libcamera/base/utils.h>
@@ -179,16 +181,6 @@ const std::map<PixelFormat, PixelFormatInfo> pixelFormatInfo{
 		.pixelsPerGroup = 1,
 		.planes = {{ { 3, 1 }, { 0, 0 }, { 0, 0 } }},
 	} },
-	{ formats::RBG888, {
-		.name = "RBG888",
-		.format = formats::RBG888,
-		.v4l2Formats = { V4L2PixelFormat(V4L2_PIX_FMT_BGR24), },
-		.bitsPerPixel = 24,
-		.colourEncoding = PixelFormatInfo::ColourEncodingRGB,
-		.packed = false,
-		.pixelsPerGroup = 1,
-		.planes = {{ { 3, 1 }, { 0, 0 }, { 0, 0 } }},
-	} },
 	{ formats::RGB888, {
 		.name = "RGB888",
 		.format = formats::RGB888,
@@ -995,6 +987,46 @@ const std::map<PixelFormat, PixelFormatInfo> pixelFormatInfo{
 	} },
 };
 
+/*
+ * Hash indexes of pixelFormatInfo, built on first use. They replace the
+ * ordered map lookup for formats without a modifier, the linear search by
+ * name, and the double lookup of V4L2 formats through
+ * V4L2PixelFormat::toPixelFormat().
+ */
+struct PixelFormatInfoIndex {
+	PixelFormatInfoIndex();
+
+	std::unordered_map<uint32_t, const PixelFormatInfo *> byFourcc;
+	std::unordered_map<uint32_t, const PixelFormatInfo *> byV4L2;
+	std::unordered_map<std::string_view, const PixelFormatInfo *> byName;
+};
+
+PixelFormatInfoIndex::PixelFormatInfoIndex()
+{
+	for (const auto &[format, info] : pixelFormatInfo) {
+		if (!format.modifier())
+			byFourcc.emplace(format.fourcc(), &info);
+
+		byName.emplace(info.name, &info);
+
+		/*
+		 * Only index the V4L2 formats that map back to this pixel
+		 * format, to match the V4L2PixelFormat::toPixelFormat()
+		 * conversion when several pixel formats share a V4L2 format.
+		 */
+		for (const V4L2PixelFormat &v4l2Format : info.v4l2Formats) {
+			if (v4l2Format.toPixelFormat(false) == format)
+				byV4L2.emplace(v4l2Format.fourcc(), &info);
+		}
+	}
+}
+
+const PixelFormatInfoIndex &pixelFormatInfoIndex()
+{
+	static const PixelFormatInfoIndex index;
+	return index;
+}
+
 } /* namespace */
 
 /**
@@ -1011,6 +1043,13 @@ const std::map<PixelFormat, PixelFormatInfo> pixelFormatInfo{
  */
 const PixelFormatInfo &PixelFormatInfo::info(const PixelFormat &format)
 {
+	if (!format.modifier()) {
+		const auto &byFourcc = pixelFormatInfoIndex().byFourcc;
+		const auto iter = byFourcc.find(format.fourcc());
+		if (iter != byFourcc.end())
+			return *iter->second;
+	}
+
 	const auto iter = pixelFormatInfo.find(format);
 	if (iter == pixelFormatInfo.end()) {
 		LOG(Formats, Warning)
@@ -1030,6 +1069,11 @@ const PixelFormatInfo &PixelFormatInfo::info(const PixelFormat &format)
  */
 const PixelFormatInfo &PixelFormatInfo::info(const V4L2PixelFormat &format)
 {
+	const auto &byV4L2 = pixelFormatInfoIndex().byV4L2;
+	const auto index = byV4L2.find(format.fourcc());
+	if (index != byV4L2.end())
+		return *index->second;
+
 	PixelFormat pixelFormat = format.toPixelFormat(false);
 	if (!pixelFormat.isValid())
 		return pixelFormatInfoInvalid;
@@ -1049,12 +1093,12 @@ const PixelFormatInfo &PixelFormatInfo::info(const V4L2PixelFormat &format)
  */
 const PixelFormatInfo &PixelFormatInfo::info(const std::string &name)
 {
-	for (const auto &info : pixelFormatInfo) {
-		if (info.second.name == name)
-			return info.second;
-	}
+	const auto &byName = pixelFormatInfoIndex().byName;
+	const auto iter = byName.find(name);
+	if (iter == byName.end())
+		return pixelFormatInfoInvalid;
 
-	return pixelFormatInfoInvalid;
+	return *iter->second;
 }
 
 /**
@@ -8,60 +8,672 @@
  */
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <optional>
+#include <queue>
 #include <set>
+#include <sstream>
+#include <stdlib.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <libcamera/base/log.h>
+#include <libcamera/base/message.h>
+#include <libcamera/base/object.h>
+#include <libcamera/base/thread.h>
 #include <libcamera/base/utils.h>
 
 #include <libcamera/camera_manager.h>
+#include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
 #include <libcamera/geometry.h>
+#include <libcamera/property_ids.h>
 #include <libcamera/stream.h>
 
+#include <libcamera/ipa/core_ipa_interface.h>
+
 #include "libcamera/internal/bayer_format.h"
 #include "libcamera/internal/camera.h"
 #include "libcamera/internal/camera_sensor.h"
+#include "libcamera/internal/delayed_controls.h"
 #include "libcamera/internal/device_enumerator.h"
+#include "libcamera/internal/framebuffer.h"
+#include "libcamera/internal/mapped_framebuffer.h"
 #include "libcamera/internal/media_device.h"
 #include "libcamera/internal/pipeline_handler.h"
+#include "libcamera/internal/request.h"
+#include "libcamera/internal/sysfs.h"
 #include "libcamera/internal/v4l2_subdevice.h"
 #include "libcamera/internal/v4l2_videodevice.h"
 
 #include "linux/media-bus-format.h"
 
+#include "xisp_3a.h"
+#include "xisp_tracepoints.h"
+
+/* Xilinx AXI4-Stream 4:2:0 video, defined in the Xilinx kernel tree only. */
+#ifndef MEDIA_BUS_FMT_VYYUYY8_1X24
+#define MEDIA_BUS_FMT_VYYUYY8_1X24		0x202c
+#endif
+
 namespace libcamera {
 
+using namespace std::literals::chrono_literals;
+
 LOG_DEFINE_CATEGORY(XISP)
+LOG_DEFINE_CATEGORY(XISPStats)
+
+namespace {
+
+/*
+ * Read the total amount of CMA memory from /proc/meminfo, in bytes. Return 0
+ * if the kernel doesn't report it.
+ */
+uint64_t cmaTotal()
+{
+	std::ifstream meminfo("/proc/meminfo");
+	std::string key;
+	uint64_t value;
+
+	while (meminfo >> key >> value) {
+		if (key == "CmaTotal:")
+			return value * 1024;
+		meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+	}
+
+	return 0;
+}
+
+struct SensorModeInfo {
+	Size size;
+	double maxFrameRate;
+};
+
+/*
+ * Sensor modes known to be supported by the capture pipelines, with their
+ * nominal maximum frame rate at 10 bits per pixel. Only the modes also
+ * reported by the sensor driver are used. Sensors not listed here use all
+ * the sizes reported by their driver, with an unknown frame rate.
+ */
+const std::map<std::string, std::vector<SensorModeInfo>> sensorModeTable = {
+	{ "imx219", {
+		{ { 640, 480 }, 206.65 },
+		{ { 1640, 1232 }, 41.85 },
+		{ { 1920, 1080 }, 47.57 },
+		{ { 3280, 2464 }, 21.19 },
+	} },
+	{ "imx477", {
+		{ { 1332, 990 }, 120.05 },
+		{ { 2028, 1080 }, 50.03 },
+		{ { 2028, 1520 }, 40.01 },
+		{ { 4056, 3040 }, 10.00 },
+	} },
+	{ "imx500", {
+		{ { 2028, 1520 }, 30.02 },
+		{ { 4056, 3040 }, 10.00 },
+	} },
+	{ "imx708", {
+		{ { 1536, 864 }, 120.13 },
+		{ { 2304, 1296 }, 56.03 },
+		{ { 4608, 2592 }, 14.35 },
+	} },
+};
+
+/*
+ * Analogue gain model of the supported sensors, where the gain code relates
+ * to the gain as gain = base / (base - code).
+ */
+const std::map<std::string, uint32_t> sensorGainTable = {
+	{ "imx219", 256 },
+	{ "imx477", 1024 },
+	{ "imx500", 1024 },
+	{ "imx708", 1024 },
+};
+
+/*
+ * Drivers exposing the capture pipelines. The xisp-emu kernel module
+ * registers media graphs with the same entity names as xilinx-video, for the
+ * handler to be run and profiled on machines without the hardware.
+ */
+const std::array<const char *, 2> xispDrivers = {
+	"xilinx-video",
+	"xisp-emu",
+};
+
+/*
+ * ISP implementations the handler can drive. The backend of a capture
+ * pipeline is selected from the name of its ISP entity, both feed the same
+ * v_proc_ss resizers and video nodes.
+ */
+struct XISPBackend {
+	const char *name;
+	/* Part of the name of the ISP entity, see the handler constructor. */
+	const char *entity;
+	/* Media bus format of the ISP output, as fed to the resizers. */
+	uint32_t outputCode;
+	/* Largest frame the ISP can process. */
+	Size maxSize;
+};
+
+const std::array<XISPBackend, 2> xispBackends = { {
+	/* Vitis Vision HLS ISP, in the ZynqMP programmable logic. */
+	{ "hls", "ISPPipeline_accel", MEDIA_BUS_FMT_RBG888_1X24, { 4096, 4096 } },
+	/*
+	 * AIE-ML ISP on Versal AI Edge, the PL data movers around the AIE
+	 * graph are exposed as a single subdevice. The AI Engine array is
+	 * fast enough to process full resolution 8K frames, larger than the
+	 * resizers and video nodes, see kMaxVpssSize. The driver isn't
+	 * released yet, the entity name is a placeholder.
+	 */
+	{ "aie-ml", "ISPPipeline_aie", MEDIA_BUS_FMT_RBG888_1X24, { 8192, 4320 } },
+} };
+
+/* Lens position, in dioptres, mapped to the end of the VCM range. */
+constexpr float kMaxLensPosition = 15.0f;
+
+/* Nominal gamma of the ISP gamma stage at its driver default. */
+constexpr float kIspDefaultGamma = 2.2f;
+
+/* Ratio of the long to the short exposure in the multi-exposure HDR modes. */
+constexpr unsigned int kHdrDefaultRatio = 4;
+
+/* Frames the HDR channels are recorded for, as deep as the DelayedControls. */
+constexpr unsigned int kHdrChannelHistory = 16;
+
+/* Frames the ScalerCrop is recorded for, as deep as the DelayedControls. */
+constexpr unsigned int kScalerCropHistory = 16;
+
+/*
+ * The buffers of a frame complete on all the video nodes of a pipeline within
+ * this window, used to tell frames apart when the sensor timings are unknown.
+ */
+constexpr uint64_t kFrameCompletionWindow = 1000000;
+
+/* Frame start events kept to anchor the first buffer to a sensor frame. */
+constexpr unsigned int kFrameStartHistory = 4;
+
+/*
+ * The ISPPipeline_accel driver exposes its stages as custom controls whose
+ * ids aren't part of a public header. They are looked up by id, in the user
+ * class range the xisp-emu driver uses as well, or by name for drivers that
+ * number them differently.
+ */
+struct XISPControl {
+	uint32_t id;
+	const char *name;
+};
+
+constexpr XISPControl kIspRedGain = { V4L2_CID_USER_BASE | 0x1001, "Red Gain" };
+constexpr XISPControl kIspBlueGain = { V4L2_CID_USER_BASE | 0x1002, "Blue Gain" };
+constexpr XISPControl kIspGamma = { V4L2_CID_USER_BASE | 0x1003, "Gamma" };
+
+const ControlId *findIspControl(const ControlInfoMap &controls,
+				const XISPControl &control)
+{
+	auto it = controls.find(control.id);
+	if (it != controls.end())
+		return it->first;
+
+	for (const auto &[id, info] : controls) {
+		if (id->name() == control.name)
+			return id;
+	}
+
+	LOG(XISP, Debug) << "ISP control " << control.name << " not found";
+
+	return nullptr;
+}
+
+/* Scale the default of an ISP control, clamped to its range. */
+int32_t scaleIspControl(const ControlInfo &info, float scale)
+{
+	int32_t code = info.def().get<int32_t>() * scale;
+	return std::clamp(code, info.min().get<int32_t>(),
+			  info.max().get<int32_t>());
+}
+
+/*
+ * Stride of a plane of a format given the stride of its first plane. The
+ * chroma planes of semi-planar formats follow the luma plane padding.
+ */
+unsigned int planeStride(const PixelFormatInfo &info, unsigned int stride,
+			 unsigned int plane)
+{
+	return stride * info.planes[plane].bytesPerGroup / info.planes[0].bytesPerGroup;
+}
+
+unsigned int frameSize(const PixelFormatInfo &info, const Size &size,
+		       unsigned int stride)
+{
+	std::array<unsigned int, 3> strides = {};
+	for (unsigned int i = 0; i < info.numPlanes(); i++)
+		strides[i] = planeStride(info, stride, i);
+
+	return info.frameSize(size, strides);
+}
+
+bool operator==(const V4L2SubdeviceFormat &lhs, const V4L2SubdeviceFormat &rhs)
+{
+	return lhs.code == rhs.code && lhs.size == rhs.size &&
+	       lhs.colorSpace == rhs.colorSpace;
+}
+
+bool operator==(const V4L2DeviceFormat &lhs, const V4L2DeviceFormat &rhs)
+{
+	if (lhs.fourcc != rhs.fourcc || lhs.size != rhs.size ||
+	    lhs.colorSpace != rhs.colorSpace ||
+	    lhs.planesCount != rhs.planesCount)
+		return false;
+
+	for (unsigned int i = 0; i < lhs.planesCount; i++) {
+		if (lhs.planes[i].bpl != rhs.planes[i].bpl)
+			return false;
+	}
+
+	return true;
+}
+
+} /* namespace */
 
 class PipelineHandlerXISP;
 
-class XISPCameraData : public Camera::Private
+/*
+ * Object living in the thread of a camera, running functions on behalf of the
+ * pipeline handler thread and receiving the signals of the camera devices.
+ */
+class XISPCameraWorker : public Object
 {
 public:
-	XISPCameraData(PipelineHandler *ph)
-		: Camera::Private(ph)
+	int run(const std::function<int()> &func)
 	{
+		return func();
+	}
+};
+
+class XISPCameraData : public Camera::Private
+{
+public:
+	struct SensorMode {
+		unsigned int code;
+		Size size;
+		/* Nominal maximum frame rate, 0 if unknown. */
+		double maxFrameRate;
+	};
+
+	/*
+	 * Cumulative frame statistics of a pipe, reset when the camera is
+	 * started.
+	 */
+	struct FrameStats {
+		uint64_t frames = 0;
+		uint64_t dropped = 0;
+		uint64_t cancelled = 0;
+		uint64_t errors = 0;
+		uint64_t underruns = 0;
+		uint64_t latencySum = 0;
+		uint64_t latencyMax = 0;
+		unsigned int queued = 0;
+		std::optional<uint32_t> lastSequence;
+	};
+
+	/*
+	 * Sensor settings a frame has been captured with, decoded once per
+	 * frame from the delayed controls.
+	 */
+	struct SensorMetadata {
+		std::optional<uint32_t> sequence;
+		int64_t frameDuration = 0;
+		int32_t exposureTime = 0;
+		std::optional<float> analogueGain;
+		int32_t hdrChannel = controls::HdrChannelNone;
+	};
+
+	/*
+	 * Cost of filling the request metadata, reset when the camera is
+	 * started, only measured with LIBCAMERA_XISP_STATS_INTERVAL set.
+	 * Updated and read in the camera thread only.
+	 */
+	struct CompletionStats {
+		uint64_t requests = 0;
+		uint64_t costSum = 0;
+		uint64_t costMax = 0;
+		/* Requests dropped for lack of a matching frame in the sync group. */
+		uint64_t unmatched = 0;
+	};
+
+	/*
+	 * Completion of the buffers of a request in flight: the longest
+	 * queue to completion latency, in nanoseconds, and the fewest
+	 * buffers left queued to a video node.
+	 */
+	struct RequestStats {
+		uint64_t latency = 0;
+		std::optional<unsigned int> depth;
+	};
+
+	/*
+	 * A capture pipe, either a v_proc_ss resizer and its video node, or
+	 * a raw video node fed by the csi2rx directly, with no resizer.
+	 */
+	struct Pipe {
+		std::unique_ptr<V4L2Subdevice> resizer;
+		std::unique_ptr<V4L2VideoDevice> capture;
+
+		FrameStats stats;
+		std::queue<utils::time_point> queueTimes;
+
+		/* Last format requested from and applied to the video node. */
+		std::optional<std::pair<V4L2DeviceFormat, V4L2DeviceFormat>> captureFormat;
+
+		/* Number of buffer slots imported in the video node, 0 if none. */
+		unsigned int importedBuffers = 0;
+
 		/*
-		 * \todo Assume 1 channel only for now, as that's the number of
-		 * available channels our current implementation.
+		 * In latest frame mode, a single application buffer is queued
+		 * at a time, the others wait in pendingBuffers. Spare buffers
+		 * owned by the handler top the video node queue up to
+		 * kLatestFrameDepth buffers, freeSpares are the ones not
+		 * queued.
 		 */
-		streams_.resize(1);
+		std::vector<std::unique_ptr<FrameBuffer>> spares;
+		std::vector<FrameBuffer *> freeSpares;
+		std::deque<FrameBuffer *> pendingBuffers;
+		bool bufferQueued = false;
+
+		/* Mappings of the buffers statistics are gathered from. */
+		std::map<const FrameBuffer *, std::unique_ptr<MappedFrameBuffer>> mappedBuffers;
+
+		/* The video node reads frames from memory to feed the ISP. */
+		bool input = false;
+	};
+
+	/* Number of pixels sampled for the 3A statistics. */
+	static constexpr Size kStatsGrid = { 32, 24 };
+
+	/* Smallest resizer input crop, in sensor output pixels. */
+	static constexpr Size kMinCropSize = { 64, 64 };
+
+	XISPCameraData(PipelineHandler *ph, MediaDevice *media,
+		       unsigned int index)
+		: Camera::Private(ph), media_(media), backend_(nullptr),
+		  sensorEntity_(nullptr),
+		  index_(index), cmaBudget_(0),
+		  statsInterval_(0), warmStop_(false),
+		  latestFrame_(false), strideAlignment_(1), hdrRatio_(kHdrDefaultRatio),
+		  gainBase_(0), sensorDelay_(0), frameStartEnabled_(false),
+		  droppedFrames_(0),
+		  statsOffsets_{}, statsPending_(false), aeEnabled_(true),
+		  awbEnabled_(true), colourGains_{ 1.0f, 1.0f },
+		  ispRedGain_(nullptr), ispBlueGain_(nullptr), ispGamma_(nullptr),
+		  hdrMode_(controls::HdrModeOff),
+		  hdrLongExposure_(0), hdrChannels_{}, hdrQueueCount_(1),
+		  cropQueueCount_(1), scalerCropSupported_(true), syncMember_(false),
+		  running_(false), inputEntity_(nullptr), reprocessing_(false)
+	{
 	}
 
+	~XISPCameraData();
+
 	PipelineHandlerXISP *pipe();
 
-	int init();
+	void startCameraThread(std::optional<unsigned int> cpu);
+	int runInCameraThread(const std::function<int()> &func,
+			      ConnectionType type = ConnectionTypeBlocking);
+	Object *eventReceiver();
+
+	int init(unsigned int numCameras);
+	void initProperties();
+	int initSensor(const Size &maxSize);
 
-	unsigned int pipeIndex(const Stream *stream)
+	unsigned int pipeIndex(const Stream *stream) const
 	{
 		return stream - &*streams_.begin();
 	}
 
+	const Stream *rawStream() const
+	{
+		return rawPipe_ ? &streams_[*rawPipe_] : nullptr;
+	}
+
+	/*
+	 * Frames are fed from memory, the sensor is out of the pipeline. Set
+	 * by configure() when the configuration includes an input stream.
+	 */
+	bool reprocessing() const
+	{
+		return reprocessing_;
+	}
+
+	bool isInput(const Stream *stream) const
+	{
+		return pipes_[pipeIndex(stream)].input;
+	}
+
+	/* The resizer crop is expressed in the sensor mode coordinates. */
+	bool scalerCropEnabled() const
+	{
+		return scalerCropSupported_ && !reprocessing_;
+	}
+
+	unsigned int maxBufferCount(unsigned int frameSize,
+				    unsigned int numStreams) const;
+	unsigned int streamStride(const Stream *stream, const PixelFormat &pixelFormat,
+				  const Size &size, unsigned int stride = 0) const;
+
+	int initSensorModes(const Size &maxSize);
+	const SensorMode *findSensorMode(const Size &size) const;
+
+	int updateControlInfo();
+	ControlList sensorControls(const ControlList &controls) const;
+	void setHdrMode(const ControlList &controls);
+	void pushSensorControls(const ControlList &controls);
+	int setLensControls(const ControlList &controls);
+	int setScalerCrop(const Rectangle &crop);
+	void queueScalerCrop(const ControlList &controls);
+	void applyScalerCrop(uint32_t sequence);
+	const SensorMetadata *sensorMetadata(uint32_t sequence);
+	uint64_t fillRequestMetadata(const Request *request, ControlList *metadata);
+
+	XISP3AConfig algoConfig() const;
+	void collectStatistics(Pipe *pipe, const FrameBuffer *buffer);
+	void algoResultsReady(const XISP3AResults &results);
+	void applyAlgorithmControls(ControlList *controls);
+	void queueColourGains(const std::array<float, 2> &gains);
+	void queueIspControls(const ControlList &controls);
+	int applyIspControls();
+	void frameStarted(uint32_t sequence);
+	void frameCompleted(uint32_t sequence);
+	uint32_t frameSequence(uint64_t timestamp);
+
+	void resetStats();
+	void logStats() const;
+
+	int setSensorFormat(V4L2SubdeviceFormat *format, bool *changed);
+	int setSubdevFormat(V4L2Subdevice *subdev, unsigned int pad,
+			    V4L2SubdeviceFormat *format, bool *changed);
+	int setCaptureFormat(Pipe *pipe, V4L2DeviceFormat *format, bool *changed);
+	void invalidateFormats();
+	void releaseBuffers(Pipe *pipe);
+	int setIspSinkLinks();
+
+	MediaDevice *media_;
+	const XISPBackend *backend_;
+
+	/* Largest frame all the stages of the pipeline can process. */
+	Size maxSize_;
+
+	/* Probed on first acquire by initSensor(), camSensor_ is null until then. */
+	MediaEntity *sensorEntity_;
+
+	/* Index N of the vcap_mipi_N capture pipeline. */
+	unsigned int index_;
+
+	/* Memory available to the buffer pools of all streams, in bytes. */
+	uint64_t cmaBudget_;
+
+	/* Number of frames between two statistics reports, 0 to disable. */
+	unsigned int statsInterval_;
+
+	/* Keep the buffers imported across stop() and start(). */
+	bool warmStop_;
+
+	/* Deliver the most recent frame to each request, see init(). */
+	bool latestFrame_;
+
+	/* Alignment of the line stride of all streams, in bytes. */
+	unsigned int strideAlignment_;
+
+	/* Ratio of the long to the short exposure in the HDR modes. */
+	unsigned int hdrRatio_;
+
+	/* Sensor modes usable by the pipeline, sorted by increasing size. */
+	std::vector<SensorMode> sensorModes_;
+
+	/* Timings of the current sensor mode, see updateControlInfo(). */
+	IPACameraSensorInfo sensorInfo_;
+	utils::Duration lineDuration_;
+	utils::Duration minFrameDuration_;
+	utils::Duration maxFrameDuration_;
+
+	/* Gain model base from sensorGainTable, 0 if unknown. */
+	uint32_t gainBase_;
+
+	/*
+	 * Sensor controls are queued per request and applied to the frame
+	 * they have been requested for, on frame start events from the
+	 * csi2rx when supported, or on buffer completion otherwise.
+	 */
+	std::unique_ptr<DelayedControls> delayedCtrls_;
+	unsigned int sensorDelay_;
+	bool frameStartEnabled_;
+	std::optional<uint32_t> lastFrameStart_;
+
+	/*
+	 * The video nodes number their buffers, not the sensor frames. The
+	 * newest frame a buffer has been mapped to, with the timestamp of the
+	 * buffer, and the time the first frame start events have been
+	 * received at, see frameSequence().
+	 */
+	std::optional<std::pair<uint64_t, uint32_t>> lastFrame_;
+	std::deque<std::pair<uint64_t, uint32_t>> frameStarts_;
+
+	/* Sensor frames no stream has captured, reset when the camera is started. */
+	uint64_t droppedFrames_;
+
+	/*
+	 * Pipe the 3A statistics are gathered from, the first one with an
+	 * RGB output, and byte offsets of the R, G and B components in its
+	 * pixels.
+	 */
+	std::optional<unsigned int> statsPipe_;
+	std::array<unsigned int, 3> statsOffsets_;
+
+	/*
+	 * The 3A algorithms run in their own thread. A single set of
+	 * statistics is in flight at a time, frames completing while the
+	 * algorithms are busy are not measured.
+	 */
+	Thread algoThread_;
+	std::unique_ptr<XISP3A> algo_;
+	bool statsPending_;
+	std::optional<XISP3AResults> algoResults_;
+	bool aeEnabled_;
+	bool awbEnabled_;
+	std::array<float, 2> colourGains_;
+
+	/* Controls of the ISP stages, nullptr if not exposed. */
+	const ControlId *ispRedGain_;
+	const ControlId *ispBlueGain_;
+	const ControlId *ispGamma_;
+
+	/*
+	 * Current HdrMode, exposure of the long frames in lines, and HDR
+	 * channel of each entry pushed to the delayed controls, indexed by
+	 * the position of the entry in the DelayedControls queue.
+	 */
+	int32_t hdrMode_;
+	int32_t hdrLongExposure_;
+	std::array<int32_t, kHdrChannelHistory> hdrChannels_;
+	uint32_t hdrQueueCount_;
+
+	/*
+	 * ISP controls changed since the last frame start, written with a
+	 * single setControls() call per frame by applyIspControls().
+	 */
+	ControlList ispControls_;
+
+	/*
+	 * Current ScalerCrop, in pixel array coordinates, and the ScalerCrop
+	 * of each request, indexed like hdrChannels_. ScalerCrop is disabled
+	 * when the resizers reject the crop selection.
+	 */
+	Rectangle scalerCrop_;
+	std::array<Rectangle, kScalerCropHistory> scalerCrops_;
+	uint32_t cropQueueCount_;
+	bool scalerCropSupported_;
+
+	/*
+	 * Sensor settings of the last frame they have been decoded for, shared
+	 * by the statistics and the metadata of the frame.
+	 */
+	SensorMetadata sensorMetadata_;
+	CompletionStats completionStats_;
+	std::unordered_map<const Request *, RequestStats> requestStats_;
+
+	/*
+	 * Requests of a sync group member held until all members have one to
+	 * queue, and completed requests, with their timestamp, held until they
+	 * are matched with the frames of the other members.
+	 */
+	bool syncMember_;
+	std::atomic<bool> running_;
+	std::deque<Request *> syncRequests_;
+	std::deque<std::pair<Request *, uint64_t>> syncQueue_;
+
+	/*
+	 * Thread driving the video nodes and the csi2rx of the camera when
+	 * camera threads are enabled, see the pipeline handler constructor,
+	 * with the number of buffers of each queued request not completed yet.
+	 * worker_ is null when the pipeline handler thread is used.
+	 */
+	Thread cameraThread_;
+	std::unique_ptr<XISPCameraWorker> worker_;
+	std::map<const Request *, unsigned int> pendingRequests_;
+
 	std::unique_ptr<CameraSensor> camSensor_;
+	std::unique_ptr<V4L2Subdevice> vcm_;
+	std::unique_ptr<V4L2Subdevice> csi2rx_;
+	std::unique_ptr<V4L2Subdevice> xisp_;
+
+	std::vector<Pipe> pipes_;
+
+	/*
+	 * The raw pipe, when the bitstream routes the csi2rx output to a video
+	 * node, always the last one, and the Bayer formats it supports. On
+	 * bitstreams with a video node feeding the ISP from memory instead,
+	 * the raw pipe is that input node, and configurations including its
+	 * stream are reprocessed.
+	 */
+	std::optional<unsigned int> rawPipe_;
+	MediaEntity *inputEntity_;
+	std::vector<PixelFormat> rawFormats_;
+	bool reprocessing_;
+
+	/*
+	 * Last format requested from and applied to each subdevice pad of the
+	 * media graph, indexed by entity and pad.
+	 */
+	std::map<std::pair<const MediaEntity *, unsigned int>,
+		 std::pair<V4L2SubdeviceFormat, V4L2SubdeviceFormat>> formatCache_;
 
 	std::vector<Stream> streams_;
 
@@ -80,10 +692,23 @@ public:
 
 	static const std::map<PixelFormat, unsigned int> formatsMap_;
 
+	/* Per-role buffer pool depth, and limits applied by validate(). */
+	static constexpr unsigned int kBufferCountStillCapture = 2;
+	static constexpr unsigned int kBufferCountViewfinder = 4;
+	static constexpr unsigned int kBufferCountVideoRecording = 6;
+	static constexpr unsigned int kBufferCountRaw = 4;
+	static constexpr unsigned int kMinBufferCount = 2;
+	static constexpr unsigned int kMaxBufferCount = 16;
+
 	V4L2SubdeviceFormat sensorFormat_;
 
 private:
+	Status validateStride(unsigned int index);
+
 	const XISPCameraData *data_;
+
+	/* Strides computed by the last validate(), per stream configuration. */
+	std::vector<unsigned int> strides_;
 };
 
 class PipelineHandlerXISP : public PipelineHandler
@@ -107,15 +732,41 @@ protected:
 
 	int queueRequestDevice(Camera *camera, Request *request) override;
 
+	bool acquireDevice(Camera *camera) override;
+	void releaseDevice(Camera *camera) override;
+
 private:
+	static constexpr unsigned int kMaxPipelines = 4;
 	static constexpr Size kPreviewSize = { 1920, 1080 };
 	static constexpr Size kMinXISPSize = { 64, 64 };
-	static constexpr Size kMaxXISPSize = { 4096, 4096 };
 
-	struct Pipe {
-    std::unique_ptr<V4L2Subdevice> resizer;
-		std::unique_ptr<V4L2VideoDevice> capture;
-	};
+	/*
+	 * Largest frame the v_proc_ss resizers and the vcap video nodes are
+	 * synthesized for, whatever the ISP. The ISP input and the raw stream
+	 * are the sensor frame, they are bounded as well.
+	 */
+	static constexpr Size kMaxVpssSize = { 4096, 4096 };
+
+	/*
+	 * Number of V4L2 buffer slots imported on each video node. This is
+	 * larger than the stream bufferCount to let applications cycle
+	 * externally allocated dmabufs (DRM/KMS, VCU, DPU input tensors)
+	 * through the capture pipeline, while keeping each of them bound to
+	 * the same slot in the V4L2BufferCache.
+	 */
+	static constexpr unsigned int kNumImportSlots = 16;
+
+	/*
+	 * Buffers kept queued on each video node in latest frame mode, for
+	 * the DMA to keep capturing while the application buffer of the last
+	 * frame is requeued.
+	 */
+	static constexpr unsigned int kLatestFrameDepth = 2;
+
+	/* Completed requests held per sync group member, waiting for a match. */
+	static constexpr unsigned int kMaxSyncDepth = 2;
+
+	using Pipe = XISPCameraData::Pipe;
 
 	XISPCameraData *cameraData(Camera *camera)
 	{
@@ -128,152 +779,1602 @@ private:
 						     const Size &size);
 	StreamConfiguration generateRawConfiguration(Camera *camera);
 
-	void bufferReady(FrameBuffer *buffer);
+	bool createCamera(MediaDevice *media, unsigned int index,
+			  unsigned int numPipelines);
+	int openCapture(XISPCameraData *data, Pipe *pipe, MediaEntity *entity);
 
-	MediaDevice *mediaDev_;
+	int startDevice(Camera *camera, const ControlList *controls);
+	void stopStreams(Camera *camera);
+	int queueRequestControls(Camera *camera, Request *request);
+	int queueRequestBuffer(Camera *camera, Request *request,
+			       const Stream *stream, FrameBuffer *buffer);
+	void queueCameraRequest(Camera *camera, Request *request);
 
-  Size sensorBestSize_;
-  unsigned int sensorBestFormatCode_;
-  //ColorSpace sensorBestColorSpace_;
-	std::unique_ptr<V4L2Subdevice> sensor_;
-	std::unique_ptr<V4L2Subdevice> vcm_;
-	std::unique_ptr<V4L2Subdevice> csi2rx_;
-	std::unique_ptr<V4L2Subdevice> xisp_;
+	void updateStats(XISPCameraData *data, Pipe *pipe, const FrameBuffer *buffer);
+	void bufferReady(FrameBuffer *buffer);
+	void spareBufferReady(FrameBuffer *buffer);
+	void completeRequestBuffer(XISPCameraData *data, Request *request,
+				   FrameBuffer *buffer);
+	void completeCameraBuffer(XISPCameraData *data, Request *request,
+				  FrameBuffer *buffer, bool last,
+				  uint64_t timestamp);
+	void completeCameraRequest(XISPCameraData *data, Request *request,
+				   uint64_t timestamp);
+
+	int allocateSpareBuffers(XISPCameraData *data, Pipe *pipe);
+	void releaseSpareBuffers(Pipe *pipe);
+	int queueLatestFrameBuffers(XISPCameraData *data, Pipe *pipe);
+
+	void completeSyncedRequest(XISPCameraData *data, Request *request,
+				   uint64_t timestamp);
+	void dropSyncedRequest(XISPCameraData *data);
+	void matchSyncGroup();
+	bool syncGroupRunning() const;
+	void queueHeldRequest(XISPCameraData *data, Request *request);
+	void queueSyncGroup();
+
+	/* Name of the ISP entity of each backend, see the constructor. */
+	std::map<std::string, std::string> backendEntities_;
+
+	/* Drive each camera from a thread of its own, see the constructor. */
+	bool cameraThreads_;
+	std::vector<unsigned int> cameraCpus_;
 
-	std::vector<Pipe> pipes_;
+	/*
+	 * Cameras whose requests are completed in sets of frames captured
+	 * within syncTolerance_ nanoseconds of each other.
+	 */
+	std::set<std::string> syncIds_;
+	std::vector<XISPCameraData *> syncGroup_;
+	uint64_t syncTolerance_;
 };
 
 /* -----------------------------------------------------------------------------
  * Camera Data
  */
 
+XISPCameraData::~XISPCameraData()
+{
+	if (!worker_)
+		return;
+
+	/* The devices are closed in the thread they have been opened in. */
+	runInCameraThread([this]() {
+		for (Pipe &pipe : pipes_)
+			pipe.capture.reset();
+		csi2rx_.reset();
+		return 0;
+	});
+
+	cameraThread_.exit();
+	cameraThread_.wait();
+	worker_.reset();
+}
+
 PipelineHandlerXISP *XISPCameraData::pipe()
 {
 	return static_cast<PipelineHandlerXISP *>(Camera::Private::pipe());
 }
 
-/* Open and initialize pipe components. */
-int XISPCameraData::init()
+void XISPCameraData::startCameraThread(std::optional<unsigned int> cpu)
 {
-#if 0 // 0.3.2 implementation
-	int ret = camSensor_->init();
-	if (ret)
-		return ret;
-#else // 0.4.0 implementation
-	if (!camSensor_)
-		return -ENODEV;
-#endif
+	worker_ = std::make_unique<XISPCameraWorker>();
+	worker_->moveToThread(&cameraThread_);
 
-	properties_ = camSensor_->properties();
+	if (cpu) {
+		const unsigned int cpus[] = { *cpu };
+		cameraThread_.setThreadAffinity(cpus);
+	}
 
-	return 0;
+	cameraThread_.start();
 }
 
-
-/* -----------------------------------------------------------------------------
- * Camera Configuration
- */
-
 /*
- * XISPCameraConfiguration::formatsMap_ records the association between an output
- * pixel format and the xisp source pixel format to be applied to the pipeline.
+ * Run \a func in the camera thread, or directly without camera threads. The
+ * return value of \a func is only reported for blocking calls.
  */
-const std::map<PixelFormat, unsigned int> XISPCameraConfiguration::formatsMap_ = {
-	{ formats::YUYV, MEDIA_BUS_FMT_YUV8_1X24 },
-	{ formats::RGB888, MEDIA_BUS_FMT_RGB888_1X24 },
-	{ formats::BGR888, MEDIA_BUS_FMT_BGR888_1X24 },
-	{ formats::RBG888, MEDIA_BUS_FMT_RBG888_1X24 },
-};
-
-CameraConfiguration::Status XISPCameraConfiguration::validate()
+int XISPCameraData::runInCameraThread(const std::function<int()> &func,
+				      ConnectionType type)
 {
-	LOG(XISP, Debug) << "[PipelineHandlerXISP::validate] Validating Configuration";  
+	if (!worker_)
+		return func();
 
-	Status status = Valid;
+	return worker_->invokeMethod(&XISPCameraWorker::run, type, func);
+}
 
-	std::set<Stream *> availableStreams;
-	std::transform(data_->streams_.begin(), data_->streams_.end(),
-		       std::inserter(availableStreams, availableStreams.end()),
-		       [](const Stream &s) { return const_cast<Stream *>(&s); });
+/* Receiver of the device signals, in the thread the devices are driven from. */
+Object *XISPCameraData::eventReceiver()
+{
+	if (worker_)
+		return worker_.get();
 
-	if (config_.empty())
-		return Invalid;
+	return pipe();
+}
 
-  LOG(XISP, Debug) << "  [data_->streams_.size()] " << data_->streams_.size();
-  LOG(XISP, Debug) << "  [availableStreams.size()] " << availableStreams.size();
-  LOG(XISP, Debug) << "  [config_.size()] " << config_.size();
+/* Open and initialize pipe components. */
+int XISPCameraData::init(unsigned int numCameras)
+{
+	initProperties();
 
-	/* Cap the number of streams to the number of available xisp pipes. */
-	if (config_.size() > availableStreams.size()) {
-		config_.resize(availableStreams.size());
-		status = Adjusted;
-	}
+	/*
+	 * Share the CMA pool evenly between the numCameras cameras of the
+	 * board, which may run concurrently, unless a per-camera budget (in
+	 * MiB) is set through the LIBCAMERA_XISP_CMA_BUDGET environment
+	 * variable.
+	 */
+	const char *budget = utils::secure_getenv("LIBCAMERA_XISP_CMA_BUDGET");
+	if (budget)
+		cmaBudget_ = strtoull(budget, nullptr, 10) << 20;
+	else
+		cmaBudget_ = cmaTotal() / numCameras;
 
-	/* Cap the number of streams to the number of available xisp pipes. */
-	if (config_.size() > 1) {
-		config_.resize(1);
-		status = Adjusted;
-	}
+	LOG(XISP, Debug) << "  [cmaBudget_] : " << (cmaBudget_ >> 20) << " MiB";
 
-  LOG(XISP, Debug) << "  [config_.size()] " << config_.size();
+	const char *interval = utils::secure_getenv("LIBCAMERA_XISP_STATS_INTERVAL");
+	if (interval)
+		statsInterval_ = strtoul(interval, nullptr, 10);
 
-	//CameraSensor *sensor = data_->camSensor_.get();
-	//Size maxResolution = sensor->resolution();
+	/*
+	 * Applications pausing and resuming the camera often can keep the
+	 * video nodes ready to stream across stop() and start(), by setting
+	 * LIBCAMERA_XISP_WARM_STOP to 1. The buffer slots are then only
+	 * released when the format changes or the camera is released.
+	 */
+	const char *warmStop = utils::secure_getenv("LIBCAMERA_XISP_WARM_STOP");
+	if (warmStop)
+		warmStop_ = strtoul(warmStop, nullptr, 10) != 0;
 
-	/* Validate streams according to the format of the first one. */
-	const PixelFormatInfo info = PixelFormatInfo::info(config_[0].pixelFormat);
+	/*
+	 * Closed-loop applications only interested in the newest frame can
+	 * set LIBCAMERA_XISP_LATEST_FRAME to 1. The buffers of the queued
+	 * requests are then handed to the DMA one at a time, for each of them
+	 * to receive one of the next frames instead of a stale one, and
+	 * buffers owned by the handler keep the video node queues full.
+	 */
+	const char *latestFrame = utils::secure_getenv("LIBCAMERA_XISP_LATEST_FRAME");
+	if (latestFrame)
+		latestFrame_ = strtoul(latestFrame, nullptr, 10) != 0;
 
-	for (const auto &[i, config] : utils::enumerate(config_)) {
-		/* Assign streams in the order they are presented. */
+	/*
+	 * SIMD kernels, the VCU and the DPU want their input lines aligned.
+	 * Applications set the stride of each stream in its configuration,
+	 * LIBCAMERA_XISP_STRIDE_ALIGN sets the default stride alignment in
+	 * bytes, a power of two, rows are packed by default.
+	 */
+	const char *strideAlign = utils::secure_getenv("LIBCAMERA_XISP_STRIDE_ALIGN");
+	if (strideAlign) {
+		unsigned long align = strtoul(strideAlign, nullptr, 10);
+		if (align && !(align & (align - 1)))
+			strideAlignment_ = align;
+		else
+			LOG(XISP, Warning) << "Invalid stride alignment " << strideAlign;
+	}
+
+	/*
+	 * In the multi-exposure HDR modes the short frames are exposed
+	 * LIBCAMERA_XISP_HDR_RATIO times shorter than the long ones, 4 by
+	 * default.
+	 */
+	const char *hdrRatio = utils::secure_getenv("LIBCAMERA_XISP_HDR_RATIO");
+	if (hdrRatio) {
+		unsigned long ratio = strtoul(hdrRatio, nullptr, 10);
+		if (ratio >= 2)
+			hdrRatio_ = ratio;
+		else
+			LOG(XISP, Warning) << "Invalid HDR ratio " << hdrRatio;
+	}
+
+	const ControlInfoMap &ispInfo = xisp_->controls();
+	ispControls_ = ControlList(ispInfo);
+
+	ispRedGain_ = findIspControl(ispInfo, kIspRedGain);
+	ispBlueGain_ = findIspControl(ispInfo, kIspBlueGain);
+	if (!ispRedGain_ || !ispBlueGain_) {
+		LOG(XISP, Warning) << "ISP white balance gains not found, AWB disabled";
+		ispRedGain_ = nullptr;
+		ispBlueGain_ = nullptr;
+	}
+
+	ispGamma_ = findIspControl(ispInfo, kIspGamma);
+
+	LOG(XISP, Debug) << "  [ispControls] : wb " << (ispRedGain_ ? "yes" : "no")
+			 << " gamma " << (ispGamma_ ? "yes" : "no");
+
+	/* Report the ISP controls until the sensor is probed. */
+	int ret = updateControlInfo();
+	if (ret)
+		return ret;
+
+	algo_ = std::make_unique<XISP3A>();
+	algo_->moveToThread(&algoThread_);
+
+	return 0;
+}
+
+/*
+ * Report the static properties of the camera until the sensor is probed.
+ * The model is the entity name up to the I2C address, as CameraSensor
+ * reports it. The location, rotation and pixel array are reported by the
+ * sensor subdevice from the firmware and the driver, without accessing the
+ * sensor.
+ */
+void XISPCameraData::initProperties()
+{
+	const std::string &name = sensorEntity_->name();
+	properties_.set(properties::Model, name.substr(0, name.find(' ')));
+
+	V4L2Subdevice subdev(sensorEntity_);
+	if (subdev.open()) {
+		LOG(XISP, Warning) << "Failed to open sensor " << name;
+		return;
+	}
+
+	const ControlInfoMap &ctrls = subdev.controls();
+
+	auto orientation = ctrls.find(V4L2_CID_CAMERA_ORIENTATION);
+	if (orientation != ctrls.end()) {
+		switch (orientation->second.def().get<int32_t>()) {
+		case V4L2_CAMERA_ORIENTATION_FRONT:
+			properties_.set(properties::Location, properties::CameraLocationFront);
+			break;
+		case V4L2_CAMERA_ORIENTATION_BACK:
+			properties_.set(properties::Location, properties::CameraLocationBack);
+			break;
+		case V4L2_CAMERA_ORIENTATION_EXTERNAL:
+			properties_.set(properties::Location, properties::CameraLocationExternal);
+			break;
+		}
+	}
+
+	auto rotation = ctrls.find(V4L2_CID_CAMERA_SENSOR_ROTATION);
+	if (rotation != ctrls.end())
+		properties_.set(properties::Rotation, rotation->second.def().get<int32_t>());
+
+	Rectangle rect;
+	if (!subdev.getSelection(0, V4L2_SEL_TGT_NATIVE_SIZE, &rect))
+		properties_.set(properties::PixelArraySize, rect.size());
+	if (!subdev.getSelection(0, V4L2_SEL_TGT_CROP_DEFAULT, &rect))
+		properties_.set(properties::PixelArrayActiveAreas, { rect });
+}
+
+/*
+ * Probe the sensor and the lens, and initialize everything that depends on
+ * them. This is deferred to the first acquire(), to keep the sensor power up
+ * and I2C transfers out of match(). It runs in the pipeline handler thread,
+ * with the handler lock held, as the properties and controls of the camera
+ * are updated.
+ */
+int XISPCameraData::initSensor(const Size &maxSize)
+{
+	if (camSensor_)
+		return 0;
+
+	utils::time_point begin = utils::clock::now();
+
+#if 0 // 0.3.2 implementation
+	camSensor_ = std::make_unique<CameraSensor>(sensorEntity_);
+	if (camSensor_->init()) {
+		camSensor_.reset();
+		return -ENODEV;
+	}
+#else // 0.4.0 implementation
+	camSensor_ = CameraSensorFactoryBase::create(sensorEntity_);
+	if (!camSensor_)
+		return -ENODEV;
+#endif
+
+	properties_ = camSensor_->properties();
+
+	if (vcm_ && vcm_->open()) {
+		LOG(XISP, Warning) << "Failed to open VCM " << vcm_->entity()->name();
+		vcm_.reset();
+	}
+
+	int ret = initSensorModes(maxSize);
+	if (!ret)
+		ret = updateControlInfo();
+	if (ret) {
+		camSensor_.reset();
+		return ret;
+	}
+
+	std::unordered_map<uint32_t, DelayedControls::ControlParams> params = {
+		{ V4L2_CID_ANALOGUE_GAIN, { 1, false } },
+		{ V4L2_CID_EXPOSURE, { 2, false } },
+		{ V4L2_CID_VBLANK, { 2, true } },
+	};
+	delayedCtrls_ = std::make_unique<DelayedControls>(camSensor_->device(), params);
+
+	for (const auto &[id, param] : params)
+		sensorDelay_ = std::max(sensorDelay_, param.delay);
+
+	utils::duration elapsed = utils::clock::now() - begin;
+	LOG(XISP, Debug) << "  [initSensor] : " << camSensor_->id() << " in "
+			 << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+			 << " ms";
+
+	return 0;
+}
+
+void XISPCameraData::resetStats()
+{
+	for (Pipe &pipe : pipes_) {
+		pipe.stats = {};
+		pipe.queueTimes = {};
+	}
+
+	sensorMetadata_ = {};
+	completionStats_ = {};
+	requestStats_.clear();
+	droppedFrames_ = 0;
+}
+
+/*
+ * Report the cumulative frame statistics of all enabled streams through the
+ * XISPStats log category, to be scraped without enabling XISP debug logs.
+ */
+void XISPCameraData::logStats() const
+{
+	for (const Stream *stream : enabledStreams_) {
+		unsigned int index = stream - &*streams_.begin();
+		const FrameStats &stats = pipes_[index].stats;
+		uint64_t completed = stats.frames + stats.errors;
+
+		LOG(XISPStats, Info)
+			<< camSensor_->id() << " stream " << index
+			<< ": frames " << stats.frames
+			<< " dropped " << stats.dropped
+			<< " errors " << stats.errors
+			<< " cancelled " << stats.cancelled
+			<< " underruns " << stats.underruns
+			<< " latency avg "
+			<< (completed ? stats.latencySum / completed / 1000 : 0)
+			<< "us max " << stats.latencyMax / 1000 << "us";
+	}
+
+	const CompletionStats &stats = completionStats_;
+	std::ostringstream cost;
+	if (statsInterval_)
+		cost << " metadata avg "
+		     << (stats.requests ? stats.costSum / stats.requests : 0)
+		     << "ns max " << stats.costMax << "ns";
+
+	LOG(XISPStats, Info)
+		<< camSensor_->id() << ": dropped " << droppedFrames_
+		<< " requests " << stats.requests << cost.str()
+		<< " unmatched " << stats.unmatched;
+}
+
+/*
+ * Compute the deepest buffer pool that fits in the CMA budget for one of
+ * numStreams streams of frameSize bytes each.
+ */
+unsigned int XISPCameraData::maxBufferCount(unsigned int frameSize,
+					    unsigned int numStreams) const
+{
+	if (!cmaBudget_ || !frameSize)
+		return XISPCameraConfiguration::kMaxBufferCount;
+
+	uint64_t count = cmaBudget_ / numStreams / frameSize;
+
+	return std::clamp<uint64_t>(count, XISPCameraConfiguration::kMinBufferCount,
+				    XISPCameraConfiguration::kMaxBufferCount);
+}
+
+/*
+ * Compute the line stride of a stream, the requested one when it holds a
+ * line, or the minimum one aligned to strideAlignment_ otherwise, and then
+ * clamped by the video node to the line sizes its DMA engine supports, for
+ * the stride reported by validate() to be the one configure() applies.
+ */
+unsigned int XISPCameraData::streamStride(const Stream *stream,
+					  const PixelFormat &pixelFormat,
+					  const Size &size, unsigned int stride) const
+{
+	const PixelFormatInfo &info = PixelFormatInfo::info(pixelFormat);
+	unsigned int minStride = info.stride(size.width, 0);
+	if (stride < minStride)
+		stride = info.stride(size.width, 0, strideAlignment_);
+	if (stride == minStride)
+		return stride;
+
+	const Pipe &pipe = pipes_[pipeIndex(stream)];
+
+	V4L2DeviceFormat format{};
+	format.fourcc = pipe.capture->toV4L2PixelFormat(pixelFormat);
+	format.size = size;
+	format.planesCount = info.numPlanes();
+	for (unsigned int p = 0; p < info.numPlanes(); p++)
+		format.planes[p].bpl = planeStride(info, stride, p);
+
+	int ret = pipe.capture->tryFormat(&format);
+	if (ret || format.planes[0].bpl < minStride)
+		return stride;
+
+	return format.planes[0].bpl;
+}
+
+/*
+ * Build the list of sensor modes from the modes enumerated by the sensor
+ * driver, annotated with the frame rates from the sensor mode table. Modes
+ * larger than what the xisp pipeline can process are ignored.
+ */
+int XISPCameraData::initSensorModes(const Size &maxSize)
+{
+	const auto &codes = camSensor_->mbusCodes();
+	auto table = sensorModeTable.find(camSensor_->model());
+
+	/* \todo The ISP bitstreams currently only accept 10-bit RGGB. */
+	for (unsigned int code : { MEDIA_BUS_FMT_SRGGB10_1X10 }) {
+		if (std::find(codes.begin(), codes.end(), code) == codes.end())
+			continue;
+
+		for (const Size &size : camSensor_->sizes(code)) {
+			if (size.width > maxSize.width || size.height > maxSize.height)
+				continue;
+
+			double maxFrameRate = 0.0;
+
+			if (table != sensorModeTable.end()) {
+				auto info = std::find_if(table->second.begin(),
+							 table->second.end(),
+							 [&](const SensorModeInfo &i) {
+								 return i.size == size;
+							 });
+				if (info == table->second.end())
+					continue;
+
+				maxFrameRate = info->maxFrameRate;
+			}
+
+			sensorModes_.push_back({ code, size, maxFrameRate });
+		}
+	}
+
+	if (sensorModes_.empty()) {
+		LOG(XISP, Error) << "No usable mode for sensor " << camSensor_->id();
+		return -EINVAL;
+	}
+
+	std::sort(sensorModes_.begin(), sensorModes_.end(),
+		  [](const SensorMode &a, const SensorMode &b) {
+			  return a.size.width * a.size.height <
+				 b.size.width * b.size.height;
+		  });
+
+	for (const SensorMode &mode : sensorModes_)
+		LOG(XISP, Debug) << "    [mode] : " << mode.size << "-"
+				 << utils::hex(mode.code, 4) << " @ "
+				 << mode.maxFrameRate << " fps";
+
+	return 0;
+}
+
+/*
+ * Select the sensor mode for a largest stream size: the smallest mode that
+ * covers the size without upscaling in the resizer, preferring the highest
+ * frame rate between modes of the same size. Fall back to the largest mode
+ * when none covers the size.
+ */
+const XISPCameraData::SensorMode *
+XISPCameraData::findSensorMode(const Size &size) const
+{
+	const SensorMode *best = nullptr;
+
+	for (const SensorMode &mode : sensorModes_) {
+		if (mode.size.width < size.width || mode.size.height < size.height)
+			continue;
+
+		if (best && best->size.width * best->size.height <
+			    mode.size.width * mode.size.height)
+			break;
+
+		if (!best || mode.maxFrameRate > best->maxFrameRate)
+			best = &mode;
+	}
+
+	return best ? best : &sensorModes_.back();
+}
+
+/*
+ * Compute the limits of the controls applied to the sensor and lens for the
+ * current sensor mode. The line length is kept at its minimum, the frame
+ * duration is controlled through the vertical blanking only.
+ */
+int XISPCameraData::updateControlInfo()
+{
+	ControlInfoMap::Map ctrls;
+
+	if (vcm_ && !reprocessing()) {
+		ctrls[&controls::LensPosition] =
+			ControlInfo(0.0f, kMaxLensPosition, 1.0f);
+	}
+
+	if (ispRedGain_) {
+		ctrls[&controls::AwbEnable] = ControlInfo(false, true, true);
+		ctrls[&controls::ColourGains] = ControlInfo(0.0f, 8.0f, 1.0f);
+	}
+
+	if (ispGamma_) {
+		const ControlInfo &info = xisp_->controls().at(ispGamma_->id());
+		float scale = kIspDefaultGamma / info.def().get<int32_t>();
+		ctrls[&controls::Gamma] =
+			ControlInfo(info.min().get<int32_t>() * scale,
+				    info.max().get<int32_t>() * scale,
+				    kIspDefaultGamma);
+	}
+
+	lineDuration_ = {};
+
+	/*
+	 * None of the sensor controls apply to frames fed from memory, and
+	 * they are unknown until the sensor is probed.
+	 */
+	if (!camSensor_ || reprocessing()) {
+		controlInfo_ = ControlInfoMap(std::move(ctrls), controls::controls);
+		return 0;
+	}
+
+	int ret = camSensor_->sensorInfo(&sensorInfo_);
+	if (!ret) {
+		properties_.set(properties::ScalerCropMaximum, sensorInfo_.analogCrop);
+
+		if (scalerCropSupported_) {
+			const Rectangle &analogCrop = sensorInfo_.analogCrop;
+			Rectangle minCrop = Rectangle(kMinCropSize)
+				.scaledBy(analogCrop.size(), sensorInfo_.outputSize)
+				.translatedBy(analogCrop.topLeft());
+			ctrls[&controls::ScalerCrop] =
+				ControlInfo(minCrop, analogCrop, analogCrop);
+		}
+	}
+
+	if (ret || !sensorInfo_.pixelRate) {
+		LOG(XISP, Warning) << "Sensor " << camSensor_->id()
+				   << " doesn't support exposure and frame rate control";
+		controlInfo_ = ControlInfoMap(std::move(ctrls), controls::controls);
+		return 0;
+	}
+
+	lineDuration_ = sensorInfo_.minLineLength * 1.0s / sensorInfo_.pixelRate;
+	minFrameDuration_ = sensorInfo_.minFrameLength * lineDuration_;
+	maxFrameDuration_ = sensorInfo_.maxFrameLength * lineDuration_;
+
+	const std::vector<uint32_t> ids = { V4L2_CID_VBLANK };
+	ControlList sensorCtrls = camSensor_->getControls(ids);
+	int32_t vblank = sensorCtrls.get(V4L2_CID_VBLANK).get<int32_t>();
+	utils::Duration frameDuration =
+		(sensorInfo_.outputSize.height + vblank) * lineDuration_;
+
+	LOG(XISP, Debug) << "  [frameDuration] : " << minFrameDuration_.get<std::micro>()
+			 << " / " << frameDuration.get<std::micro>()
+			 << " / " << maxFrameDuration_.get<std::micro>() << " us";
+
+	ctrls[&controls::FrameDurationLimits] =
+		ControlInfo(static_cast<int64_t>(minFrameDuration_.get<std::micro>()),
+			    static_cast<int64_t>(maxFrameDuration_.get<std::micro>()),
+			    static_cast<int64_t>(frameDuration.get<std::micro>()));
+
+	const ControlInfoMap &sensorInfo = camSensor_->controls();
+
+	auto exposure = sensorInfo.find(V4L2_CID_EXPOSURE);
+	if (exposure != sensorInfo.end()) {
+		const ControlInfo &info = exposure->second;
+		ctrls[&controls::ExposureTime] =
+			ControlInfo(static_cast<int32_t>(info.min().get<int32_t>() * lineDuration_.get<std::micro>()),
+				    static_cast<int32_t>(info.max().get<int32_t>() * lineDuration_.get<std::micro>()),
+				    static_cast<int32_t>(info.def().get<int32_t>() * lineDuration_.get<std::micro>()));
+		ctrls[&controls::AeEnable] = ControlInfo(false, true, true);
+
+		std::vector<ControlValue> hdrModes = {
+			static_cast<int32_t>(controls::HdrModeOff),
+			static_cast<int32_t>(controls::HdrModeMultiExposureUnmerged),
+		};
+
+		ctrls[&controls::HdrMode] =
+			ControlInfo(hdrModes, static_cast<int32_t>(controls::HdrModeOff));
+	}
+
+	auto gain = sensorInfo.find(V4L2_CID_ANALOGUE_GAIN);
+	auto model = sensorGainTable.find(camSensor_->model());
+	if (gain != sensorInfo.end() && model != sensorGainTable.end()) {
+		const ControlInfo &info = gain->second;
+		gainBase_ = model->second;
+
+		auto toGain = [&](int32_t code) {
+			return static_cast<float>(gainBase_) / (gainBase_ - code);
+		};
+
+		ctrls[&controls::AnalogueGain] =
+			ControlInfo(toGain(info.min().get<int32_t>()),
+				    toGain(info.max().get<int32_t>()),
+				    toGain(info.def().get<int32_t>()));
+	}
+
+	controlInfo_ = ControlInfoMap(std::move(ctrls), controls::controls);
+
+	return 0;
+}
+
+/*
+ * Convert the libcamera controls of a request to the V4L2 controls of the
+ * sensor. Without AE to pick a frame duration within FrameDurationLimits,
+ * the sensor runs at the shortest allowed frame duration.
+ */
+ControlList XISPCameraData::sensorControls(const ControlList &controls) const
+{
+	ControlList ctrls(camSensor_->controls());
+
+	if (!lineDuration_)
+		return ctrls;
+
+	const auto &limits = controls.get(controls::FrameDurationLimits);
+	if (limits) {
+		utils::Duration duration = std::chrono::microseconds((*limits)[0]);
+		duration = std::clamp(duration, minFrameDuration_, maxFrameDuration_);
+
+		uint32_t frameLength = duration / lineDuration_;
+		int32_t vblank = frameLength - sensorInfo_.outputSize.height;
+		ctrls.set(V4L2_CID_VBLANK, vblank);
+	}
+
+	const auto &exposure = controls.get(controls::ExposureTime);
+	if (exposure) {
+		int32_t lines = std::chrono::microseconds(*exposure) / lineDuration_;
+		ctrls.set(V4L2_CID_EXPOSURE, lines);
+	}
+
+	const auto &gain = controls.get(controls::AnalogueGain);
+	if (gain && gainBase_) {
+		float value = std::max(*gain, 1.0f);
+		int32_t code = gainBase_ - gainBase_ / value;
+		ctrls.set(V4L2_CID_ANALOGUE_GAIN, code);
+	}
+
+	return ctrls;
+}
+
+/* Track the HdrMode of a request. */
+void XISPCameraData::setHdrMode(const ControlList &controls)
+{
+	const auto &mode = controls.get(controls::HdrMode);
+	if (!mode || *mode == hdrMode_)
+		return;
+
+	auto info = controlInfo_.find(&controls::HdrMode);
+	if (info == controlInfo_.end() ||
+	    std::find(info->second.values().begin(), info->second.values().end(),
+		      ControlValue(*mode)) == info->second.values().end()) {
+		LOG(XISP, Warning) << "Unsupported HDR mode " << *mode;
+		return;
+	}
+
+	hdrMode_ = *mode;
+
+	LOG(XISP, Debug) << "  [hdrMode] : " << hdrMode_;
+}
+
+/*
+ * Queue the sensor controls of a request. In the HDR modes the requests
+ * alternate between a long exposure, the one set by the application or AE,
+ * and a short exposure hdrRatio_ times shorter. Sensors latch the exposure
+ * per frame, no mode switch is involved.
+ */
+void XISPCameraData::pushSensorControls(const ControlList &controls)
+{
+	ControlList ctrls = sensorControls(controls);
+	int32_t last = hdrChannels_[(hdrQueueCount_ - 1) % kHdrChannelHistory];
+	int32_t channel = controls::HdrChannelNone;
+
+	if (ctrls.contains(V4L2_CID_EXPOSURE))
+		hdrLongExposure_ = ctrls.get(V4L2_CID_EXPOSURE).get<int32_t>();
+
+	if (hdrMode_ != controls::HdrModeOff) {
+		const ControlInfo &info = camSensor_->controls().at(V4L2_CID_EXPOSURE);
+		int32_t lines = hdrLongExposure_;
+
+		if (last == controls::HdrChannelLong) {
+			channel = controls::HdrChannelShort;
+			lines = std::max<int32_t>(lines / hdrRatio_,
+						  info.min().get<int32_t>());
+		} else {
+			channel = controls::HdrChannelLong;
+		}
+
+		ctrls.set(V4L2_CID_EXPOSURE, lines);
+	} else if (last == controls::HdrChannelShort) {
+		/* Don't leave the sensor on the short exposure. */
+		ctrls.set(V4L2_CID_EXPOSURE, hdrLongExposure_);
+	}
+
+	delayedCtrls_->push(ctrls);
+	hdrChannels_[hdrQueueCount_++ % kHdrChannelHistory] = channel;
+}
+
+/*
+ * The VCM is a separate device moving on its own time base, lens controls
+ * are applied immediately. The lens position is mapped linearly to the VCM
+ * range, from infinity to kMaxLensPosition dioptres.
+ */
+int XISPCameraData::setLensControls(const ControlList &controls)
+{
+	const auto &position = controls.get(controls::LensPosition);
+	if (!vcm_ || !position)
+		return 0;
+
+	const ControlInfoMap &vcmInfo = vcm_->controls();
+	auto focus = vcmInfo.find(V4L2_CID_FOCUS_ABSOLUTE);
+	if (focus == vcmInfo.end())
+		return 0;
+
+	int32_t min = focus->second.min().get<int32_t>();
+	int32_t max = focus->second.max().get<int32_t>();
+	float ratio = std::clamp(*position / kMaxLensPosition, 0.0f, 1.0f);
+
+	ControlList ctrls(vcmInfo);
+	ctrls.set(V4L2_CID_FOCUS_ABSOLUTE,
+		  static_cast<int32_t>(min + ratio * (max - min)));
+
+	return vcm_->setControls(&ctrls);
+}
+
+/*
+ * Crop the resizer inputs to a rectangle expressed in pixel array
+ * coordinates. The resizers don't preserve the aspect ratio, the crop of each
+ * pipe is shrunk to the aspect ratio of its stream around the requested
+ * centre.
+ */
+int XISPCameraData::setScalerCrop(const Rectangle &crop)
+{
+	const Rectangle &analogCrop = sensorInfo_.analogCrop;
+	const Size &outputSize = sensorInfo_.outputSize;
+
+	Rectangle bounded = crop.enclosedIn(analogCrop);
+	if (bounded == scalerCrop_)
+		return 0;
+
+	/* Convert to the sensor output coordinates, as fed to the resizers. */
+	Rectangle ispCrop = bounded.translatedBy(-analogCrop.topLeft())
+				   .scaledBy(outputSize, analogCrop.size());
+	Size cropSize = ispCrop.size().expandedTo(kMinCropSize).boundedTo(outputSize);
+
+	for (const Stream *stream : enabledStreams_) {
+		Pipe &pipe = pipes_[pipeIndex(stream)];
+		if (!pipe.resizer)
+			continue;
+
+		Size size = cropSize.boundedToAspectRatio(stream->configuration().size)
+				    .alignedDownTo(2, 2);
+		Rectangle rect = size.centeredTo(ispCrop.center())
+				     .enclosedIn(Rectangle(outputSize));
+
+		int ret = pipe.resizer->setSelection(0, V4L2_SEL_TGT_CROP, &rect);
+		if (ret)
+			return ret;
+
+		LOG(XISP, Debug) << "  [crop] : stream " << pipeIndex(stream)
+				 << " " << rect;
+	}
+
+	scalerCrop_ = bounded;
+
+	return 0;
+}
+
+/*
+ * Queue the ScalerCrop of a request, or the previous one when the request
+ * carries none. Like the sensor controls, it applies to the frame of the
+ * request, see applyScalerCrop().
+ */
+void XISPCameraData::queueScalerCrop(const ControlList &controls)
+{
+	const auto &crop = controls.get(controls::ScalerCrop);
+	Rectangle rect = crop ? crop->enclosedIn(sensorInfo_.analogCrop)
+			      : scalerCrops_[(cropQueueCount_ - 1) % kScalerCropHistory];
+
+	scalerCrops_[cropQueueCount_++ % kScalerCropHistory] = rect;
+}
+
+/*
+ * Write the ScalerCrop of the frame following \a sequence to the resizers,
+ * at the start of frame \a sequence, as they latch their crop on the next
+ * frame boundary.
+ */
+void XISPCameraData::applyScalerCrop(uint32_t sequence)
+{
+	/* Repeat the last crop when running out of queued requests. */
+	while (cropQueueCount_ < sequence + 2) {
+		scalerCrops_[cropQueueCount_ % kScalerCropHistory] =
+			scalerCrops_[(cropQueueCount_ - 1) % kScalerCropHistory];
+		cropQueueCount_++;
+	}
+
+	if (!scalerCropEnabled())
+		return;
+
+	int ret = setScalerCrop(scalerCrops_[(sequence + 1) % kScalerCropHistory]);
+	if (ret)
+		LOG(XISP, Error) << "Failed to set the crop: " << ret;
+}
+
+/*
+ * Retrieve the exposure, gain and frame duration the sensor has been using
+ * for the frame with the given sequence number, or nullptr if unknown.
+ */
+const XISPCameraData::SensorMetadata *XISPCameraData::sensorMetadata(uint32_t sequence)
+{
+	if (!lineDuration_)
+		return nullptr;
+
+	if (sensorMetadata_.sequence == sequence)
+		return &sensorMetadata_;
+
+	ControlList ctrls = delayedCtrls_->get(sequence);
+	SensorMetadata &metadata = sensorMetadata_;
+	metadata.sequence = sequence;
+
+	int32_t vblank = ctrls.get(V4L2_CID_VBLANK).get<int32_t>();
+	utils::Duration frameDuration =
+		(sensorInfo_.outputSize.height + vblank) * lineDuration_;
+	metadata.frameDuration = static_cast<int64_t>(frameDuration.get<std::micro>());
+
+	int32_t lines = ctrls.get(V4L2_CID_EXPOSURE).get<int32_t>();
+	metadata.exposureTime = static_cast<int32_t>(lines * lineDuration_.get<std::micro>());
+
+	if (gainBase_) {
+		int32_t code = ctrls.get(V4L2_CID_ANALOGUE_GAIN).get<int32_t>();
+		metadata.analogueGain = static_cast<float>(gainBase_) / (gainBase_ - code);
+	}
+
+	/* The entry pushed for a frame is applied sensorDelay_ frames later. */
+	uint32_t index = sequence < sensorDelay_ ? 0 : sequence - sensorDelay_;
+	metadata.hdrChannel = hdrChannels_[index % kHdrChannelHistory];
+
+	return &metadata;
+}
+
+/*
+ * Fill \a metadata for a request, once all its buffers have completed. The
+ * timestamp and sensor settings are the ones of the first frame captured
+ * for the request. Return the timestamp, or 0 if all buffers were cancelled.
+ */
+uint64_t XISPCameraData::fillRequestMetadata(const Request *request,
+					     ControlList *metadata)
+{
+	/* Only pay for the clock reads when the statistics are reported. */
+	utils::time_point begin;
+	if (statsInterval_)
+		begin = utils::clock::now();
+
+	const FrameMetadata *frame = nullptr;
+	for (const auto &[stream, buffer] : request->buffers()) {
+		const FrameMetadata &info = buffer->metadata();
+		if (info.status == FrameMetadata::FrameCancelled || isInput(stream))
+			continue;
+
+		if (!frame || info.timestamp < frame->timestamp)
+			frame = &info;
+	}
+
+	std::optional<RequestStats> requestStats;
+	auto it = requestStats_.find(request);
+	if (it != requestStats_.end()) {
+		requestStats = it->second;
+		requestStats_.erase(it);
+	}
+
+	if (!frame)
+		return 0;
+
+	metadata->set(controls::SensorTimestamp, frame->timestamp);
+
+	const SensorMetadata *sensor = sensorMetadata(frame->sequence);
+	if (sensor) {
+		metadata->set(controls::FrameDuration, sensor->frameDuration);
+		metadata->set(controls::ExposureTime, sensor->exposureTime);
+		if (sensor->analogueGain)
+			metadata->set(controls::AnalogueGain, *sensor->analogueGain);
+		if (sensor->hdrChannel != controls::HdrChannelNone)
+			metadata->set(controls::HdrChannel, sensor->hdrChannel);
+	}
+
+	if (ispRedGain_)
+		metadata->set(controls::ColourGains, { colourGains_[0], colourGains_[1] });
+
+	if (scalerCropEnabled())
+		metadata->set(controls::ScalerCrop,
+			      scalerCrops_[frame->sequence % kScalerCropHistory]);
+
+	int64_t errors = 0;
+	int64_t cancelled = 0;
+	int64_t underruns = 0;
+	for (const Stream *stream : enabledStreams_) {
+		const FrameStats &stats = pipes_[pipeIndex(stream)].stats;
+		errors += stats.errors;
+		cancelled += stats.cancelled;
+		underruns += stats.underruns;
+	}
+
+	metadata->set(controls::xisp::DroppedFrames, droppedFrames_);
+	metadata->set(controls::xisp::FrameErrors, errors);
+	metadata->set(controls::xisp::CancelledFrames, cancelled);
+	metadata->set(controls::xisp::BufferUnderruns, underruns);
+
+	if (requestStats) {
+		metadata->set(controls::xisp::RequestLatency, requestStats->latency / 1000);
+		if (requestStats->depth)
+			metadata->set(controls::xisp::QueueDepth, *requestStats->depth);
+	}
+
+	completionStats_.requests++;
+
+	if (statsInterval_) {
+		utils::duration cost = utils::clock::now() - begin;
+		uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(cost).count();
+		completionStats_.costSum += ns;
+		completionStats_.costMax = std::max(completionStats_.costMax, ns);
+	}
+
+	return frame->timestamp;
+}
+
+/* Limits of the AE algorithm, from the controls of the current sensor mode. */
+XISP3AConfig XISPCameraData::algoConfig() const
+{
+	XISP3AConfig config{};
+
+	auto exposure = controlInfo_.find(&controls::ExposureTime);
+	if (exposure != controlInfo_.end()) {
+		config.minExposureTime = exposure->second.min().get<int32_t>();
+		config.maxExposureTime = exposure->second.max().get<int32_t>();
+	}
+
+	config.minAnalogueGain = 1.0f;
+	config.maxAnalogueGain = 1.0f;
+
+	auto gain = controlInfo_.find(&controls::AnalogueGain);
+	if (gain != controlInfo_.end()) {
+		config.minAnalogueGain = gain->second.min().get<float>();
+		config.maxAnalogueGain = gain->second.max().get<float>();
+	}
+
+	return config;
+}
+
+/*
+ * Sample a sparse grid of a completed frame and hand the statistics over to
+ * the algorithms thread. This runs in bufferReady() and is bounded by the
+ * grid size, not by the frame size.
+ */
+void XISPCameraData::collectStatistics(Pipe *pipe, const FrameBuffer *buffer)
+{
+	/* AE runs on the long frames only, the short ones follow them. */
+	const SensorMetadata *sensor = sensorMetadata(buffer->metadata().sequence);
+	if (sensor && sensor->hdrChannel == controls::HdrChannelShort)
+		return;
+
+	auto it = pipe->mappedBuffers.find(buffer);
+	if (it == pipe->mappedBuffers.end()) {
+		auto mapped = std::make_unique<MappedFrameBuffer>(buffer,
+								  MappedFrameBuffer::MapFlag::Read);
+		if (!mapped->isValid()) {
+			LOG(XISP, Warning) << "Failed to map buffer, 3A disabled";
+			statsPipe_.reset();
+			return;
+		}
+
+		it = pipe->mappedBuffers.emplace(buffer, std::move(mapped)).first;
+	}
+
+	const V4L2DeviceFormat &format = pipe->captureFormat->second;
+	const unsigned int stride = format.planes[0].bpl;
+	Span<uint8_t> plane = it->second->planes()[0];
+
+	XISPStatistics stats{};
+	stats.sequence = buffer->metadata().sequence;
+	stats.aeEnabled = aeEnabled_;
+	stats.awbEnabled = awbEnabled_ && ispRedGain_;
+
+	for (unsigned int y = 0; y < kStatsGrid.height; y++) {
+		/* Sample the centre of each grid cell. */
+		size_t row = (2 * y + 1) * format.size.height / (2 * kStatsGrid.height);
+
+		for (unsigned int x = 0; x < kStatsGrid.width; x++) {
+			size_t col = (2 * x + 1) * format.size.width / (2 * kStatsGrid.width);
+			size_t offset = row * stride + col * 3;
+			if (offset + 3 > plane.size())
+				continue;
+
+			const uint8_t *pixel = plane.data() + offset;
+			uint8_t max = 0;
+
+			for (unsigned int i = 0; i < 3; i++) {
+				uint8_t value = pixel[statsOffsets_[i]];
+				stats.sum[i] += value;
+				max = std::max(max, value);
+			}
+
+			if (max == 255)
+				stats.saturated++;
+			stats.samples++;
+		}
+	}
+
+	stats.exposureTime = sensor ? sensor->exposureTime : 0;
+	stats.analogueGain = sensor ? sensor->analogueGain.value_or(1.0f) : 1.0f;
+
+	statsPending_ = true;
+	algo_->invokeMethod(&XISP3A::process, ConnectionTypeQueued, stats);
+}
+
+/* Runs in the pipeline handler thread, queued from the algorithms thread. */
+void XISPCameraData::algoResultsReady(const XISP3AResults &results)
+{
+	statsPending_ = false;
+
+	if (results.colourGains && awbEnabled_)
+		queueColourGains(*results.colourGains);
+
+	/* Sensor settings are applied with the next queued request. */
+	if (results.exposureTime || results.analogueGain)
+		algoResults_ = results;
+}
+
+/*
+ * Track the 3A enable controls of a request, and complete the request with
+ * the latest AE results. Controls set explicitly in the request take
+ * precedence.
+ */
+void XISPCameraData::applyAlgorithmControls(ControlList *controls)
+{
+	const auto &aeEnable = controls->get(controls::AeEnable);
+	if (aeEnable)
+		aeEnabled_ = *aeEnable;
+
+	const auto &awbEnable = controls->get(controls::AwbEnable);
+	if (awbEnable)
+		awbEnabled_ = *awbEnable;
+
+	if (!algoResults_ || !aeEnabled_)
+		return;
+
+	if (algoResults_->exposureTime &&
+	    !controls->contains(controls::ExposureTime.id()))
+		controls->set(controls::ExposureTime, *algoResults_->exposureTime);
+
+	if (algoResults_->analogueGain &&
+	    !controls->contains(controls::AnalogueGain.id()))
+		controls->set(controls::AnalogueGain, *algoResults_->analogueGain);
+
+	algoResults_.reset();
+}
+
+/*
+ * The ISP gains are expressed relative to the driver defaults, taken as the
+ * neutral white balance.
+ */
+void XISPCameraData::queueColourGains(const std::array<float, 2> &gains)
+{
+	const ControlInfoMap &ispInfo = xisp_->controls();
+
+	ispControls_.set(ispRedGain_->id(),
+			 scaleIspControl(ispInfo.at(ispRedGain_->id()), gains[0]));
+	ispControls_.set(ispBlueGain_->id(),
+			 scaleIspControl(ispInfo.at(ispBlueGain_->id()), gains[1]));
+
+	colourGains_ = gains;
+}
+
+/*
+ * Convert the ISP controls of a request to the ISPPipeline_accel controls.
+ * The values are only recorded here, and written at the next frame start.
+ * Manual colour gains are ignored while AWB is enabled.
+ */
+void XISPCameraData::queueIspControls(const ControlList &controls)
+{
+	const ControlInfoMap &ispInfo = xisp_->controls();
+
+	const auto &gains = controls.get(controls::ColourGains);
+	if (gains && ispRedGain_ && !awbEnabled_)
+		queueColourGains({ (*gains)[0], (*gains)[1] });
+
+	const auto &gamma = controls.get(controls::Gamma);
+	if (gamma && ispGamma_)
+		ispControls_.set(ispGamma_->id(),
+				 scaleIspControl(ispInfo.at(ispGamma_->id()),
+						 *gamma / kIspDefaultGamma));
+}
+
+/* Write all the ISP controls queued since the last call. */
+int XISPCameraData::applyIspControls()
+{
+	if (ispControls_.empty())
+		return 0;
+
+	int ret = xisp_->setControls(&ispControls_);
+	if (ret)
+		LOG(XISP, Error) << "Failed to set ISP controls: " << ret;
+
+	ispControls_.clear();
+
+	return ret;
+}
+
+/*
+ * Frame start handler, from the csi2rx events or emulated on buffer
+ * completion. Sensor and ISP controls and the crop are written once per
+ * frame here.
+ */
+void XISPCameraData::frameStarted(uint32_t sequence)
+{
+	if (!reprocessing())
+		delayedCtrls_->applyControls(sequence);
+	applyIspControls();
+	applyScalerCrop(sequence);
+
+	/* The frame start events anchor the buffers to the sensor frames. */
+	if (frameStartEnabled_ && !lastFrame_) {
+		utils::duration now = utils::clock::now().time_since_epoch();
+		frameStarts_.emplace_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(),
+					  sequence);
+		if (frameStarts_.size() > kFrameStartHistory)
+			frameStarts_.pop_front();
+	}
+
+	/*
+	 * DelayedControls repeats its last entry when it runs out of queued
+	 * requests, do the same with the HDR channels to stay in step.
+	 */
+	while (hdrQueueCount_ < sequence + 1) {
+		hdrChannels_[hdrQueueCount_ % kHdrChannelHistory] =
+			hdrChannels_[(hdrQueueCount_ - 1) % kHdrChannelHistory];
+		hdrQueueCount_++;
+	}
+}
+
+/*
+ * Without frame start events, the first buffer completing for a frame marks
+ * the start of the next one. Requests don't need to carry a buffer for every
+ * stream, the buffer can come from any of them, and frames no stream has
+ * been captured for are started along with the next one. Only the last
+ * sensorDelay_ of them can still affect the sensor.
+ */
+void XISPCameraData::frameCompleted(uint32_t sequence)
+{
+	if (frameStartEnabled_)
+		return;
+
+	if (lastFrameStart_ && sequence < *lastFrameStart_)
+		return;
+
+	uint32_t next = sequence + 1;
+	uint32_t frame = lastFrameStart_ ? *lastFrameStart_ + 1 : next;
+	if (next - frame > sensorDelay_)
+		frame = next - sensorDelay_;
+
+	for (; frame <= next; frame++)
+		frameStarted(frame);
+
+	lastFrameStart_ = next;
+}
+
+/*
+ * Map a captured buffer to the sensor frame it holds, from its timestamp. A
+ * frame dropped for lack of a buffer, or not requested on a stream, leaves no
+ * gap in the buffer sequence of a video node, the buffer sequence can't be
+ * used to index the DelayedControls.
+ *
+ * The first buffer is mapped to the last frame start event received before
+ * its timestamp, or to frame 0 without frame start events, where frames are
+ * numbered by frameCompleted() only. The following buffers are placed
+ * relative to the newest frame mapped so far, in frame durations of the
+ * sensor controls that frame has been captured with.
+ */
+uint32_t XISPCameraData::frameSequence(uint64_t timestamp)
+{
+	if (!lastFrame_) {
+		uint32_t sequence = 0;
+		for (const auto &[time, start] : frameStarts_) {
+			if (time <= timestamp)
+				sequence = start;
+		}
+
+		frameStarts_.clear();
+		lastFrame_ = { timestamp, sequence };
+		return sequence;
+	}
+
+	auto [lastTimestamp, lastSequence] = *lastFrame_;
+	int64_t delta = static_cast<int64_t>(timestamp - lastTimestamp);
+	int64_t frames;
+
+	const SensorMetadata *sensor = sensorMetadata(lastSequence);
+	if (sensor && sensor->frameDuration > 0)
+		frames = std::lround(delta / (sensor->frameDuration * 1000.0));
+	else if (std::abs(delta) > static_cast<int64_t>(kFrameCompletionWindow))
+		frames = delta > 0 ? 1 : -1;
+	else
+		frames = 0;
+
+	/* Buffers of older frames may complete late on some video nodes. */
+	if (frames < 0)
+		return lastSequence < -frames ? 0 : lastSequence + frames;
+
+	if (frames > 0) {
+		lastFrame_ = { timestamp, lastSequence + frames };
+		droppedFrames_ += frames - 1;
+	}
+
+	return lastSequence + frames;
+}
+
+/*
+ * The set*Format() functions below program the media graph in pipeline
+ * order, skipping the ioctl when the format requested for a pad is the same
+ * as the last one applied to it. As drivers propagate formats from sink to
+ * source pads, \a changed is set as soon as one entity gets reprogrammed,
+ * which forces all the entities downstream to be reprogrammed as well.
+ */
+int XISPCameraData::setSensorFormat(V4L2SubdeviceFormat *format, bool *changed)
+{
+	auto key = std::make_pair(camSensor_->entity(), 0U);
+	auto it = formatCache_.find(key);
+	if (!*changed && it != formatCache_.end() && it->second.first == *format) {
+		*format = it->second.second;
+		return 0;
+	}
+
+	V4L2SubdeviceFormat requested = *format;
+	int ret = camSensor_->setFormat(format);
+	if (ret) {
+		invalidateFormats();
+		return ret;
+	}
+
+	formatCache_[key] = { requested, *format };
+	*changed = true;
+
+	return 0;
+}
+
+int XISPCameraData::setSubdevFormat(V4L2Subdevice *subdev, unsigned int pad,
+				    V4L2SubdeviceFormat *format, bool *changed)
+{
+	auto key = std::make_pair(subdev->entity(), pad);
+	auto it = formatCache_.find(key);
+	if (!*changed && it != formatCache_.end() && it->second.first == *format) {
+		*format = it->second.second;
+		return 0;
+	}
+
+	V4L2SubdeviceFormat requested = *format;
+	int ret = subdev->setFormat(pad, format);
+	if (ret) {
+		invalidateFormats();
+		return ret;
+	}
+
+	formatCache_[key] = { requested, *format };
+	*changed = true;
+
+	return 0;
+}
+
+int XISPCameraData::setCaptureFormat(Pipe *pipe, V4L2DeviceFormat *format,
+				     bool *changed)
+{
+	if (!*changed && pipe->captureFormat &&
+	    pipe->captureFormat->first == *format) {
+		*format = pipe->captureFormat->second;
+		return 0;
+	}
+
+	/* The format can't be changed with buffers allocated. */
+	releaseBuffers(pipe);
+	pipe->spares.clear();
+	pipe->freeSpares.clear();
+
+	V4L2DeviceFormat requested = *format;
+	int ret = pipe->capture->setFormat(format);
+	if (ret) {
+		invalidateFormats();
+		return ret;
+	}
+
+	pipe->captureFormat = { requested, *format };
+	*changed = true;
+
+	return 0;
+}
+
+/*
+ * Drop the cached formats, for the whole media graph to be reprogrammed by
+ * the next configure().
+ */
+void XISPCameraData::invalidateFormats()
+{
+	formatCache_.clear();
+
+	for (Pipe &pipe : pipes_)
+		pipe.captureFormat.reset();
+}
+
+/*
+ * Route the csi2rx or, when reprocessing, the input video node to the ISP.
+ * Media links persist across processes, both are set on every configuration.
+ */
+int XISPCameraData::setIspSinkLinks()
+{
+	MediaLink *csiLink = nullptr;
+	MediaLink *inputLink = nullptr;
+
+	for (const MediaPad *pad : xisp_->entity()->pads()) {
+		if (!(pad->flags() & MEDIA_PAD_FL_SINK))
+			continue;
+
+		for (MediaLink *link : pad->links()) {
+			MediaEntity *source = link->source()->entity();
+			if (source == csi2rx_->entity())
+				csiLink = link;
+			else if (source == inputEntity_)
+				inputLink = link;
+		}
+	}
+
+	/* Without an input video node the csi2rx link is immutable. */
+	if (!inputLink)
+		return reprocessing_ ? -ENODEV : 0;
+
+	/* Only one link to the ISP sink can be enabled at a time. */
+	MediaLink *disable = reprocessing_ ? csiLink : inputLink;
+	MediaLink *enable = reprocessing_ ? inputLink : csiLink;
+
+	if (disable) {
+		int ret = disable->setEnabled(false);
+		if (ret)
+			return ret;
+	}
+
+	return enable ? enable->setEnabled(true) : 0;
+}
+
+void XISPCameraData::releaseBuffers(Pipe *pipe)
+{
+	if (!pipe->importedBuffers)
+		return;
+
+	pipe->capture->releaseBuffers();
+	pipe->importedBuffers = 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Camera Configuration
+ */
+
+/*
+ * XISPCameraConfiguration::formatsMap_ records the association between an output
+ * pixel format and the v_proc_ss source media bus format to be applied to the
+ * pipeline. The xisp output is always RBG, YUV formats are produced by the
+ * v_proc_ss colour space converter and chroma resampler.
+ *
+ * RBG is the component order of the Xilinx AXI4-Stream video bus, not a memory
+ * layout. The vcap frame buffer writes standard RGB layouts from it, RGB888
+ * as V4L2 BGR24 and BGR888 as V4L2 RGB24.
+ */
+const std::map<PixelFormat, unsigned int> XISPCameraConfiguration::formatsMap_ = {
+	{ formats::YUYV, MEDIA_BUS_FMT_UYVY8_1X16 },
+	{ formats::NV12, MEDIA_BUS_FMT_VYYUYY8_1X24 },
+	{ formats::NV16, MEDIA_BUS_FMT_UYVY8_1X16 },
+	{ formats::RGB888, MEDIA_BUS_FMT_RBG888_1X24 },
+	{ formats::BGR888, MEDIA_BUS_FMT_RBG888_1X24 },
+};
+
+/*
+ * Set the line stride of a stream configuration. A stride set by the
+ * application is kept when the video node supports it, the default stride
+ * of the stream is used otherwise. The strides filled by a previous call
+ * aren't requests, they follow the size and format of the stream.
+ */
+CameraConfiguration::Status XISPCameraConfiguration::validateStride(unsigned int index)
+{
+	StreamConfiguration &config = config_[index];
+	strides_.resize(config_.size());
+
+	unsigned int requested = config.stride != strides_[index] ? config.stride : 0;
+	unsigned int stride = data_->streamStride(config.stream(), config.pixelFormat,
+						  config.size, requested);
+
+	Status status = Valid;
+	if (requested && stride != requested) {
+		LOG(XISP, Debug) << "  Stream " << index << ": stride adjusted from "
+				 << requested << " to " << stride;
+		status = Adjusted;
+	}
+
+	config.stride = stride;
+	strides_[index] = stride;
+
+	return status;
+}
+
+CameraConfiguration::Status XISPCameraConfiguration::validate()
+{
+	LOG(XISP, Debug) << "[PipelineHandlerXISP::validate] Validating Configuration";
+
+	Status status = Valid;
+
+	std::set<Stream *> availableStreams;
+	std::transform(data_->streams_.begin(), data_->streams_.end(),
+		       std::inserter(availableStreams, availableStreams.end()),
+		       [](const Stream &s) { return const_cast<Stream *>(&s); });
+
+	/* The raw stream is only assigned to raw configurations. */
+	Stream *rawStream = const_cast<Stream *>(data_->rawStream());
+	if (rawStream)
+		availableStreams.erase(rawStream);
+
+	if (config_.empty())
+		return Invalid;
+
+	LOG(XISP, Debug) << "  [data_->streams_.size()] " << data_->streams_.size();
+	LOG(XISP, Debug) << "  [availableStreams.size()] " << availableStreams.size();
+	LOG(XISP, Debug) << "  [config_.size()] " << config_.size();
+
+	/* Cap the number of streams to the number of available xisp pipes. */
+	if (config_.size() > data_->streams_.size()) {
+		config_.resize(data_->streams_.size());
+		status = Adjusted;
+	}
+
+	LOG(XISP, Debug) << "  [config_.size()] " << config_.size();
+
+	StreamConfiguration *rawConfig = nullptr;
+
+	for (const auto &[i, config] : utils::enumerate(config_)) {
+		const PixelFormatInfo &pixelInfo = PixelFormatInfo::info(config.pixelFormat);
+
+		if (pixelInfo.colourEncoding == PixelFormatInfo::ColourEncodingRAW &&
+		    rawStream && !rawConfig) {
+			/* The raw size is set by the sensor mode, see below. */
+			const auto &formats = data_->rawFormats_;
+			if (std::find(formats.begin(), formats.end(),
+				      config.pixelFormat) == formats.end()) {
+				config.pixelFormat = formats[0];
+				status = Adjusted;
+			}
+
+			config.setStream(rawStream);
+			rawConfig = &config;
+			continue;
+		}
+
+		if (availableStreams.empty()) {
+			LOG(XISP, Error) << "Stream " << i << ": no processed stream left";
+			return Invalid;
+		}
+
+		/*
+		 * Each stream is produced by its own resizer and video node,
+		 * validate the pixel format of every stream independently.
+		 */
+		if (formatsMap_.find(config.pixelFormat) == formatsMap_.end()) {
+			LOG(XISP, Debug) << "  Stream " << i << ": unsupported format "
+					 << config.pixelFormat << ", adjusting";
+			config.pixelFormat = formats::RGB888;
+			status = Adjusted;
+		}
+
+		const PixelFormatInfo &info = PixelFormatInfo::info(config.pixelFormat);
+
+		/*
+		 * Bound the size to the pipeline limits and align it to the
+		 * chroma subsampling of the format.
+		 */
+		unsigned int vAlign = 1;
+		for (unsigned int p = 0; p < info.numPlanes(); p++)
+			vAlign = std::max(vAlign, info.planes[p].verticalSubSampling);
+
+		Size size = config.size.boundedTo(data_->maxSize_)
+				       .alignedDownTo(info.pixelsPerGroup, vAlign);
+		if (size != config.size) {
+			LOG(XISP, Debug) << "  Stream " << i << ": size adjusted from "
+					 << config.size << " to " << size;
+			config.size = size;
+			status = Adjusted;
+		}
+
+		/* Assign streams in the order they are presented. */
 		auto stream = availableStreams.extract(availableStreams.begin());
 		config.setStream(stream.value());
 
-		config.stride = info.stride(config.size.width, 0);
-		config.frameSize = info.frameSize(config.size, info.bitsPerPixel);
- 
+		if (validateStride(i) == Adjusted)
+			status = Adjusted;
+		config.frameSize = frameSize(info, config.size, config.stride);
+
+		/* Clamp the buffer pool depth to the camera CMA budget. */
+		unsigned int maxCount = data_->maxBufferCount(config.frameSize,
+							      config_.size());
+		unsigned int bufferCount = std::clamp(config.bufferCount,
+						      kMinBufferCount, maxCount);
+		if (bufferCount != config.bufferCount) {
+			LOG(XISP, Debug) << "  Stream " << i << ": bufferCount adjusted from "
+					 << config.bufferCount << " to " << bufferCount;
+			config.bufferCount = bufferCount;
+			status = Adjusted;
+		}
+
 		LOG(XISP, Debug) << "  Stream " << i << ": " << config.toString();
-		//LOG(XISP, Debug) << "    [config] : " << config;
-		LOG(XISP, Debug) << "    [config.size] : " << config.size;
-		LOG(XISP, Debug) << "    [config.pixelFormat] : " << config.pixelFormat;
 		LOG(XISP, Debug) << "    [config.stride] : " << config.stride;
 		LOG(XISP, Debug) << "    [config.frameSize] : " << config.frameSize;
-  }
+	}
 
 	/*
-	 * Sensor format selection policy: the first stream selects the media
-	 * bus code to use, the largest stream selects the size.
+	 * Sensor format selection policy: an explicit sensor configuration
+	 * selects the mode with the same output size, otherwise the largest
+	 * stream selects the mode through findSensorMode().
 	 *
 	 * \todo The sensor format selection policy could be changed to
 	 * prefer operating the sensor at full resolution to prioritize
 	 * image quality in exchange of a usually slower frame rate.
 	 * Usage of the STILL_CAPTURE role could be consider for this.
 	 */
-	Size maxSize;
-	for (const auto &cfg : config_) {
-		if (cfg.size > maxSize)
-			maxSize = cfg.size;
-	}
+	const XISPCameraData::SensorMode *mode = nullptr;
 
-	//PixelFormat pixelFormat = config_[0].pixelFormat;
+	if (sensorConfig) {
+		if (!sensorConfig->isValid() || sensorConfig->bitDepth != 10) {
+			LOG(XISP, Error) << "Invalid sensor configuration";
+			return Invalid;
+		}
+
+		for (const auto &m : data_->sensorModes_) {
+			if (m.size == sensorConfig->outputSize)
+				mode = &m;
+		}
 
-	V4L2SubdeviceFormat sensorFormat{};
-	//sensorFormat.code = data_->getMediaBusFormat(&pixelFormat);
-	//	MEDIA_BUS_FMT_UYVY8_1X16,
-	//	MEDIA_BUS_FMT_YUV8_1X24,
-	//	MEDIA_BUS_FMT_RGB565_1X16,
-	//	MEDIA_BUS_FMT_RGB888_1X24,
-  //sensorFormat.code = MEDIA_BUS_FMT_UYVY8_1X16;
-  sensorFormat.code = MEDIA_BUS_FMT_RBG888_1X24;
-  //sensorFormat.code = MEDIA_BUS_FMT_RGB888_1X24;
-	sensorFormat.size = maxSize;
+		if (!mode) {
+			LOG(XISP, Error) << "Unsupported sensor output size "
+					 << sensorConfig->outputSize;
+			return Invalid;
+		}
+	} else {
+		Size maxSize;
+		for (const auto &cfg : config_) {
+			if (cfg.size > maxSize)
+				maxSize = cfg.size;
+		}
 
-	LOG(XISP, Debug) << "Computed sensor configuration: " << sensorFormat;
+		mode = data_->findSensorMode(maxSize);
+	}
 
-	sensorFormat_.code = sensorFormat.code;
-	sensorFormat_.size = sensorFormat.size;
+	sensorFormat_.code = mode->code;
+	sensorFormat_.size = mode->size;
 
 	LOG(XISP, Debug) << "Selected sensor format: " << sensorFormat_;
 
+	/* The raw stream captures the sensor output as-is. */
+	if (rawConfig) {
+		if (rawConfig->size != mode->size) {
+			LOG(XISP, Debug) << "Raw stream size adjusted from "
+					 << rawConfig->size << " to " << mode->size;
+			rawConfig->size = mode->size;
+			status = Adjusted;
+		}
+
+		const PixelFormatInfo &info = PixelFormatInfo::info(rawConfig->pixelFormat);
+		if (validateStride(rawConfig - &config_[0]) == Adjusted)
+			status = Adjusted;
+		rawConfig->frameSize = frameSize(info, rawConfig->size, rawConfig->stride);
+
+		unsigned int maxCount = data_->maxBufferCount(rawConfig->frameSize,
+							      config_.size());
+		unsigned int bufferCount = std::clamp(rawConfig->bufferCount,
+						      kMinBufferCount, maxCount);
+		if (bufferCount != rawConfig->bufferCount) {
+			rawConfig->bufferCount = bufferCount;
+			status = Adjusted;
+		}
+	}
+
 	return status;
 }
 
@@ -282,8 +2383,72 @@ CameraConfiguration::Status XISPCameraConfiguration::validate()
  */
 
 PipelineHandlerXISP::PipelineHandlerXISP(CameraManager *manager)
-	: PipelineHandler(manager)
+	: PipelineHandler(manager), cameraThreads_(false),
+	  syncTolerance_(1000000)
 {
+	/*
+	 * The ISP entity of each backend is matched from part of its name.
+	 * The names can be overridden with LIBCAMERA_XISP_ISP_ENTITIES, a
+	 * list of backend=name pairs, for instance
+	 * "aie-ml=ISPPipeline_aie_ml", for AIE-ML bitstreams whose entity
+	 * name differs from the placeholder in xispBackends.
+	 */
+	for (const XISPBackend &backend : xispBackends)
+		backendEntities_[backend.name] = backend.entity;
+
+	const char *entities = utils::secure_getenv("LIBCAMERA_XISP_ISP_ENTITIES");
+	if (entities) {
+		for (const std::string &entry : utils::split(entities, ",")) {
+			size_t pos = entry.find('=');
+			std::string name = entry.substr(0, pos);
+			if (pos == std::string::npos || !backendEntities_.count(name)) {
+				LOG(XISP, Warning) << "Invalid ISP entity " << entry;
+				continue;
+			}
+
+			backendEntities_[name] = entry.substr(pos + 1);
+		}
+	}
+
+	/*
+	 * All cameras share the pipeline handler thread, a slow completion on
+	 * one of them delays the others. With LIBCAMERA_XISP_CAMERA_THREADS=1,
+	 * the video nodes and csi2rx of each camera are driven from a thread
+	 * of its own, where buffers are dequeued, queued and processed. Only
+	 * the buffer and request completion is handed over to the pipeline
+	 * handler thread. LIBCAMERA_XISP_CAMERA_CPUS optionally pins the
+	 * threads to CPUs, one per vcap_mipi_N index, for instance "1,2,3,0".
+	 */
+	const char *threads = utils::secure_getenv("LIBCAMERA_XISP_CAMERA_THREADS");
+	if (threads)
+		cameraThreads_ = strtoul(threads, nullptr, 10) != 0;
+
+	const char *cpus = utils::secure_getenv("LIBCAMERA_XISP_CAMERA_CPUS");
+	if (cpus) {
+		for (const std::string &cpu : utils::split(cpus, ","))
+			cameraCpus_.push_back(strtoul(cpu.c_str(), nullptr, 10));
+	}
+
+	/*
+	 * Multi-view applications can pair the frames of several cameras by
+	 * listing their ids, separated by colons, in LIBCAMERA_XISP_SYNC_GROUP.
+	 * The requests of the group members are then queued together, one
+	 * request per camera, and complete in matched sets whose timestamps
+	 * differ by no more than LIBCAMERA_XISP_SYNC_TOLERANCE microseconds
+	 * (1 ms by default). Frames without a match complete with the
+	 * FrameError status, see dropSyncedRequest().
+	 */
+	const char *group = utils::secure_getenv("LIBCAMERA_XISP_SYNC_GROUP");
+	if (group) {
+		for (const std::string &id : utils::split(group, ":")) {
+			if (!id.empty())
+				syncIds_.insert(id);
+		}
+	}
+
+	const char *tolerance = utils::secure_getenv("LIBCAMERA_XISP_SYNC_TOLERANCE");
+	if (tolerance)
+		syncTolerance_ = strtoull(tolerance, nullptr, 10) * 1000;
 }
 
 
@@ -295,98 +2460,133 @@ PipelineHandlerXISP::generateConfiguration(Camera *camera,
 	std::unique_ptr<XISPCameraConfiguration> config =
 		std::make_unique<XISPCameraConfiguration>(data);
 
-  LOG(XISP, Debug) << "[PipelineHandlerXISP::generateConfiguration] Generate Configuration";  
+	LOG(XISP, Debug) << "[PipelineHandlerXISP::generateConfiguration] Generate Configuration";
 
 	if (roles.empty())
 		return config;
 
-  LOG(XISP, Debug) << "  [roles.size()] " << roles.size();
-  LOG(XISP, Debug) << "  [data->streams_.size()] " << data->streams_.size();
-  
+	/* The sensor modes are only known once the sensor is probed. */
+	if (!data->camSensor_) {
+		LOG(XISP, Error)
+			<< "Camera must be acquired before generating configurations";
+		return nullptr;
+	}
+
+	LOG(XISP, Debug) << "  [roles.size()] " << roles.size();
+	LOG(XISP, Debug) << "  [data->streams_.size()] " << data->streams_.size();
+
 	if (roles.size() > data->streams_.size()) {
 		LOG(XISP, Error) << "Only up to " << data->streams_.size()
 				<< " streams are supported";
 		return nullptr;
 	}
 
+	bool rawRequested = false;
+
 	for (const auto &role : roles) {
-    switch (role) {
-      case StreamRole::StillCapture: {
-        LOG(XISP, Debug) << "  [role] StilCapture";
-        break;
-      }      
-      case StreamRole::Viewfinder: {
-        LOG(XISP, Debug) << "  [role] Viewfinder";
-        break;
-      }      
-      case StreamRole::VideoRecording: {
-        LOG(XISP, Debug) << "  [role] VideoRecording";
-        break;
-      }      
-      case StreamRole::Raw: {
-        LOG(XISP, Debug) << "  [role] Raw";
-        break;
-      }      
-		  default: {
-        LOG(XISP, Error) << "Requested stream role not supported: " << role;
-        return nullptr;
-      }
+		unsigned int bufferCount;
+
+		switch (role) {
+		case StreamRole::StillCapture:
+			LOG(XISP, Debug) << "  [role] StillCapture";
+			bufferCount = XISPCameraConfiguration::kBufferCountStillCapture;
+			break;
+
+		case StreamRole::Viewfinder:
+			LOG(XISP, Debug) << "  [role] Viewfinder";
+			bufferCount = XISPCameraConfiguration::kBufferCountViewfinder;
+			break;
+
+		case StreamRole::VideoRecording:
+			LOG(XISP, Debug) << "  [role] VideoRecording";
+			bufferCount = XISPCameraConfiguration::kBufferCountVideoRecording;
+			break;
+
+		case StreamRole::Raw:
+			LOG(XISP, Debug) << "  [role] Raw";
+			if (!data->rawPipe_ || rawRequested) {
+				LOG(XISP, Error) << "Raw capture not available";
+				return nullptr;
+			}
+			rawRequested = true;
+			bufferCount = XISPCameraConfiguration::kBufferCountRaw;
+			break;
+
+		default:
+			LOG(XISP, Error) << "Requested stream role not supported: " << role;
+			return nullptr;
 		}
-  }
+
+		/* Populate one StreamConfiguration per role, each on its own pipe. */
+		StreamConfiguration cfg = role == StreamRole::Raw
+					? generateRawConfiguration(camera)
+					: generateYUVConfiguration(camera, { 640, 480 });
+		cfg.bufferCount = bufferCount;
+		config->addConfiguration(cfg);
+	}
+
+	config->validate();
+
+	return config;
+}
+
+StreamConfiguration
+PipelineHandlerXISP::generateYUVConfiguration(Camera *camera, const Size &size)
+{
+	XISPCameraData *data = cameraData(camera);
 
 	/*
-	 * Populate the StreamConfiguration.
-	 *
 	 * As the sensor supports at least one YUV/RGB media bus format all the
 	 * processed ones in formatsMap_ can be generated from it.
 	 */
 	std::map<PixelFormat, std::vector<SizeRange>> streamFormats;
-	for (const auto &[pixFmt, pipeFmt] : XISPCameraConfiguration::formatsMap_) {
-		//const PixelFormatInfo &info = PixelFormatInfo::info(pixFmt);
-		streamFormats[pixFmt] = { { kMinXISPSize, kMaxXISPSize } };
-	}
-	for (auto const &streamFormat : streamFormats) {
-    LOG(XISP, Debug) << "  [streamFormat] " << streamFormat.first;
-    for (auto const &sizeRange : streamFormat.second ) {
-      LOG(XISP, Debug) << "    [sizeRange] " << sizeRange;    
-    } 
-  }
- 
+	for (const auto &[pixFmt, pipeFmt] : XISPCameraConfiguration::formatsMap_)
+		streamFormats[pixFmt] = { { kMinXISPSize, data->maxSize_ } };
+
+	for (const auto &[pixelFormat, sizeRanges] : streamFormats) {
+		LOG(XISP, Debug) << "  [streamFormat] " << pixelFormat;
+		for (const SizeRange &sizeRange : sizeRanges)
+			LOG(XISP, Debug) << "    [sizeRange] " << sizeRange;
+	}
+
 	StreamFormats formats(streamFormats);
-	for (auto const &pixelFormat : formats.pixelformats()) {
-    LOG(XISP, Debug) << "  [formats.pixelformats()] " << pixelFormat;
-  	for (auto const &size : formats.sizes(pixelFormat)) {
-      LOG(XISP, Debug) << "    [formats.sizes(" << pixelFormat << ")] " << size;
-    }        
-  }
- 
-  StreamConfiguration cfg(formats);
-  //LOG(XISP, Debug) << "  [cfg] : " << cfg.toString();
-
-  //cfg.size = {1920,1080};
-  //cfg.size = {1280,720};
-  cfg.size = {640,480};
-  //cfg.pixelFormat = formats::YUYV;
-  //cfg.pixelFormat = formats::BGR888;
-  //cfg.pixelFormat = formats::RGB888;
-  cfg.pixelFormat = formats::RBG888;
-  
-	const PixelFormatInfo info = PixelFormatInfo::info(cfg.pixelFormat);
-	cfg.stride = info.stride(cfg.size.width, 0);
-	cfg.frameSize = info.frameSize(cfg.size, info.bitsPerPixel);
-
-  cfg.bufferCount = 4;
-
-  LOG(XISP, Debug) << "  [cfg] : " << cfg.toString();
-  LOG(XISP, Debug) << "    [cfg.size] : " << cfg.size;
-  LOG(XISP, Debug) << "    [cfg.pixelFormat] : " << cfg.pixelFormat;
-  LOG(XISP, Debug) << "    [cfg.stride] : " << cfg.stride;
-  LOG(XISP, Debug) << "    [cfg.frameSize] : " << cfg.frameSize;
-        
-	config->addConfiguration(cfg);
-	config->validate();
+	StreamConfiguration cfg(formats);
 
-	return config;
+	cfg.size = size;
+	cfg.pixelFormat = formats::RGB888;
+
+	/* The stride and frame size are set by validate(). */
+	cfg.bufferCount = XISPCameraConfiguration::kBufferCountViewfinder;
+
+	LOG(XISP, Debug) << "  [cfg] : " << cfg.toString();
+
+	return cfg;
+}
+
+StreamConfiguration
+PipelineHandlerXISP::generateRawConfiguration(Camera *camera)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	/* The raw stream can only be captured at the size of a sensor mode. */
+	std::vector<SizeRange> sizes;
+	for (const auto &mode : data->sensorModes_)
+		sizes.emplace_back(mode.size);
+
+	std::map<PixelFormat, std::vector<SizeRange>> streamFormats;
+	for (const PixelFormat &pixelFormat : data->rawFormats_)
+		streamFormats[pixelFormat] = sizes;
+
+	StreamConfiguration cfg{ StreamFormats{ streamFormats } };
+	cfg.pixelFormat = data->rawFormats_[0];
+	cfg.size = data->sensorModes_.back().size;
+
+	/* The stride and frame size are set by validate(). */
+	cfg.bufferCount = XISPCameraConfiguration::kBufferCountRaw;
+
+	LOG(XISP, Debug) << "  [cfg] : " << cfg.toString();
+
+	return cfg;
 }
 
 int PipelineHandlerXISP::configure(Camera *camera, CameraConfiguration *c)
@@ -394,162 +2594,606 @@ int PipelineHandlerXISP::configure(Camera *camera, CameraConfiguration *c)
 	XISPCameraConfiguration *camConfig = static_cast<XISPCameraConfiguration *>(c);
 	XISPCameraData *data = cameraData(camera);
 
-  LOG(XISP, Debug) << "[PipelineHandlerXISP::configure] Configure Camera";  
+	LOG(XISP, Debug) << "[PipelineHandlerXISP::configure] Configure Camera";
 
-	/* All links are immutable except the sensor -> csis link. */
-	const MediaPad *sensorSrc = data->camSensor_->entity()->getPadByIndex(0);
-	sensorSrc->links()[0]->setEnabled(true);
+	/* Reprocess the frames of the input stream when it is configured. */
+	const Stream *rawStream = data->rawStream();
+	bool reprocessing = rawStream && data->isInput(rawStream) &&
+			    std::any_of(camConfig->begin(), camConfig->end(),
+					[rawStream](const StreamConfiguration &cfg) {
+						return cfg.stream() == rawStream;
+					});
 
-  int ret;
-  
-  // Defined a fixed format
-  V4L2SubdeviceFormat csi2rxFormat{};
-  V4L2SubdeviceFormat xispFormat{};
-	V4L2SubdeviceFormat vpssFormat{};
-	V4L2DeviceFormat    captureFormat{};
-  
-  csi2rxFormat.code = sensorBestFormatCode_;
-  csi2rxFormat.size.width  = sensorBestSize_.width;
-  csi2rxFormat.size.height = sensorBestSize_.height;
-  //csi2rxFormat.colorSpace = ColorSpace::Srgb;
-
-  xispFormat.code = MEDIA_BUS_FMT_RBG888_1X24;
-  //xispFormat.code = MEDIA_BUS_FMT_RGB888_1X24;
-  xispFormat.size.width  = sensorBestSize_.width;
-  xispFormat.size.height = sensorBestSize_.height;
-  //xispFormat.colorSpace = ColorSpace::Srgb;
-  
-	vpssFormat = camConfig->sensorFormat_;
-  vpssFormat.code = MEDIA_BUS_FMT_RBG888_1X24;
-  //vpssFormat.code = MEDIA_BUS_FMT_RGB888_1X24;
-  //vpssFormat.colorSpace = ColorSpace::Srgb;
-   
-	/* Apply format to the sensor and CSIS receiver. */
-	ret = data->camSensor_->setFormat(&csi2rxFormat);
+	/* The sensor controls are only available on live capture. */
+	if (reprocessing != data->reprocessing_) {
+		data->reprocessing_ = reprocessing;
+		data->updateControlInfo();
+	}
+
+	/*
+	 * All links are immutable except the sensor -> csis link, disabled
+	 * when reprocessing to leave the sensor out of the pipeline, and the
+	 * links to the ISP sink.
+	 */
+	const MediaPad *sensorSrc = data->camSensor_->entity()->getPadByIndex(0);
+	int ret = sensorSrc->links()[0]->setEnabled(!data->reprocessing());
 	if (ret)
 		return ret;
 
-  LOG(XISP, Debug) << "  [CSI ] : " << csi2rxFormat;
-	//ret = data->csi2rx_->setFormat(0, &format);
-  ret = csi2rx_->setFormat(0, &csi2rxFormat);
-	if (ret)
+	ret = data->setIspSinkLinks();
+	if (ret) {
+		LOG(XISP, Error) << "Failed to route the ISP input";
 		return ret;
-  ret = csi2rx_->setFormat(1, &csi2rxFormat);
+	}
+
+	/*
+	 * The csi2rx forwards the sensor format, and the xisp converts it to
+	 * the output format of the backend.
+	 */
+	V4L2SubdeviceFormat csi2rxFormat = camConfig->sensorFormat_;
+	V4L2SubdeviceFormat xispFormat{};
+	V4L2SubdeviceFormat vpssFormat{};
+	V4L2DeviceFormat captureFormat{};
+
+	xispFormat.code = data->backend_->outputCode;
+	xispFormat.size = camConfig->sensorFormat_.size;
+
+	/*
+	 * Apply format to the sensor and CSIS receiver. Entities whose format
+	 * didn't change since the last configuration are skipped, up to the
+	 * first one that needs to be reprogrammed.
+	 */
+	bool changed = false;
+
+	if (!data->reprocessing()) {
+		ret = data->setSensorFormat(&csi2rxFormat, &changed);
+		if (ret)
+			return ret;
+
+		LOG(XISP, Debug) << "  [CSI ] : " << csi2rxFormat;
+		ret = data->setSubdevFormat(data->csi2rx_.get(), 0, &csi2rxFormat, &changed);
+		if (ret)
+			return ret;
+		ret = data->setSubdevFormat(data->csi2rx_.get(), 1, &csi2rxFormat, &changed);
+		if (ret)
+			return ret;
+	}
+
+	LOG(XISP, Debug) << "  [XISP] : " << xispFormat;
+	ret = data->setSubdevFormat(data->xisp_.get(), 0, &csi2rxFormat, &changed);
 	if (ret)
 		return ret;
-
-  LOG(XISP, Debug) << "  [XISP] : " << xispFormat;
-  ret = xisp_->setFormat(0, &csi2rxFormat);
+	ret = data->setSubdevFormat(data->xisp_.get(), 1, &xispFormat, &changed);
 	if (ret)
 		return ret;
-  ret = xisp_->setFormat(1, &xispFormat);
+
+	LOG(XISP, Debug) << "  [changed] : " << changed;
+
+	/* The frame duration limits depend on the sensor mode. */
+	ret = data->updateControlInfo();
 	if (ret)
 		return ret;
 
 	/* Now configure the resizer and video node instances, one per stream. */
 	data->enabledStreams_.clear();
- 
-	//for (const auto &config : *c) {
- 	for (const auto &[i, config] : utils::enumerate(*c)) {
+	data->statsPipe_.reset();
+	Size statsSize;
+
+	for (const auto &[i, config] : utils::enumerate(*c)) {
 		LOG(XISP, Debug) << "  Stream " << i << ": " << config.toString();
-    //LOG(XISP, Debug) << "    [config] : " << config;
-    LOG(XISP, Debug) << "    [config.size] : " << config.size;
-    LOG(XISP, Debug) << "    [config.pixelFormat] : " << config.pixelFormat;
-    LOG(XISP, Debug) << "    [config.stride] : " << config.stride;
-    LOG(XISP, Debug) << "    [config.frameSize] : " << config.frameSize;
-		
-    //Pipe *pipe = pipeFromStream(camera, config.stream());
-    Pipe *pipe = &pipes_[0];
-
-    LOG(XISP, Debug) << "  [VPSS] : " << vpssFormat;
-		//ret = pipe->xisp->setFormat(0, &format);
-    ret = pipe->resizer->setFormat(0, &xispFormat);
+
+		Pipe *pipe = pipeFromStream(camera, config.stream());
+
+		/* The raw video node captures the csi2rx output. */
+		if (!pipe->resizer) {
+			const PixelFormatInfo &info = PixelFormatInfo::info(config.pixelFormat);
+
+			captureFormat = {};
+			captureFormat.fourcc = pipe->capture->toV4L2PixelFormat(config.pixelFormat);
+			captureFormat.size = csi2rxFormat.size;
+			captureFormat.planesCount = info.numPlanes();
+			captureFormat.planes[0].bpl = config.stride;
+
+			LOG(XISP, Debug) << "  [RAW ] : " << captureFormat;
+			bool rawChanged = changed;
+			ret = data->setCaptureFormat(pipe, &captureFormat, &rawChanged);
+			if (ret)
+				return ret;
+
+			if (captureFormat.planes[0].bpl != config.stride)
+				LOG(XISP, Warning) << "Raw stride " << config.stride
+						   << " adjusted to " << captureFormat.planes[0].bpl;
+
+			data->enabledStreams_.push_back(config.stream());
+			continue;
+		}
+
+		/*
+		 * Every resizer scales the shared xisp output to its own stream
+		 * size, and converts it to the media bus format of the stream.
+		 */
+		vpssFormat.code = XISPCameraConfiguration::formatsMap_.at(config.pixelFormat);
+		vpssFormat.size = config.size;
+
+		/* A change in the shared part of the graph applies to all pipes. */
+		bool pipeChanged = changed;
+
+		LOG(XISP, Debug) << "  [VPSS] : " << vpssFormat;
+		ret = data->setSubdevFormat(pipe->resizer.get(), 0, &xispFormat, &pipeChanged);
 		if (ret)
 			return ret;
-    ret = pipe->resizer->setFormat(1, &vpssFormat);
+		ret = data->setSubdevFormat(pipe->resizer.get(), 1, &vpssFormat, &pipeChanged);
 		if (ret)
 			return ret;
 
-  	const PixelFormatInfo &info = PixelFormatInfo::info(config.pixelFormat);
-  	captureFormat.fourcc = pipe->capture->toV4L2PixelFormat(config.pixelFormat);
-	  captureFormat.size = config.size;
-    captureFormat.planesCount = info.numPlanes();
-    captureFormat.planes[0].bpl = config.stride;
-
-    LOG(XISP, Debug) << "  [VCAP] : " << captureFormat;
-    LOG(XISP, Debug) << "    [captureFormat] : " << captureFormat.toString();
-    LOG(XISP, Debug) << "      [captureFormat.planesCount] : " << captureFormat.planesCount;
-    //LOG(XISP, Debug) << "      [captureFormat.planes[0].bpl] : " << captureFormat.planes[0].bpl;
-		/* \todo Set stride and format. */
-		ret = pipe->capture->setFormat(&captureFormat);
+		const PixelFormatInfo &info = PixelFormatInfo::info(config.pixelFormat);
+		captureFormat.fourcc = pipe->capture->toV4L2PixelFormat(config.pixelFormat);
+		captureFormat.size = config.size;
+		captureFormat.planesCount = info.numPlanes();
+		for (unsigned int p = 0; p < info.numPlanes(); p++)
+			captureFormat.planes[p].bpl = planeStride(info, config.stride, p);
+
+		LOG(XISP, Debug) << "  [VCAP] : " << captureFormat;
+		ret = data->setCaptureFormat(pipe, &captureFormat, &pipeChanged);
 		if (ret)
 			return ret;
-      
-    //if (captureFormat.size != config.size)
-    //  return -EINVAL;
+
+		/* validate() queried the stride from the video node already. */
+		if (captureFormat.planes[0].bpl != config.stride)
+			LOG(XISP, Warning) << "Stream " << data->pipeIndex(config.stream())
+					   << " stride " << config.stride << " adjusted to "
+					   << captureFormat.planes[0].bpl;
+
+		/*
+		 * Gather the 3A statistics from the smallest RGB stream. Small
+		 * streams, such as inference inputs, are the most likely to be
+		 * captured for every frame, while full resolution streams may
+		 * only be requested at a lower rate.
+		 */
+		std::optional<std::array<unsigned int, 3>> offsets;
+		if (captureFormat.fourcc == V4L2PixelFormat(V4L2_PIX_FMT_BGR24))
+			offsets = { 2, 1, 0 };
+		else if (captureFormat.fourcc == V4L2PixelFormat(V4L2_PIX_FMT_RGB24))
+			offsets = { 0, 1, 2 };
+
+		if (offsets && (!data->statsPipe_ || config.size < statsSize)) {
+			data->statsPipe_ = data->pipeIndex(config.stream());
+			data->statsOffsets_ = *offsets;
+			statsSize = config.size;
+		}
 
 		/* Store the list of enabled streams for later use. */
 		data->enabledStreams_.push_back(config.stream());
 	}
 
+	/*
+	 * Setting the resizer sink format resets its crop, start from the
+	 * full field of view.
+	 */
+	if (data->scalerCropEnabled()) {
+		data->scalerCrop_ = {};
+		ret = data->setScalerCrop(data->sensorInfo_.analogCrop);
+		if (ret) {
+			LOG(XISP, Warning) << "Resizers don't support cropping, ScalerCrop disabled";
+			data->scalerCropSupported_ = false;
+			data->updateControlInfo();
+		}
+	}
+
 	return 0;
 }
 
 int PipelineHandlerXISP::exportFrameBuffers(Camera *camera, Stream *stream,
 					   std::vector<std::unique_ptr<FrameBuffer>> *buffers)
 {
-	unsigned int count = stream->configuration().bufferCount;
+	XISPCameraData *data = cameraData(camera);
+	const StreamConfiguration &config = stream->configuration();
 	Pipe *pipe = pipeFromStream(camera, stream);
 
-	return pipe->capture->exportBuffers(count, buffers);
+	int ret = pipe->capture->exportBuffers(config.bufferCount, buffers);
+	if (ret < 0)
+		return ret;
+
+	/* The driver may allocate fewer buffers than requested, report it. */
+	LOG(XISP, Info) << "Stream " << data->pipeIndex(stream) << ": allocated "
+			<< ret << " of " << config.bufferCount << " buffers ("
+			<< ((static_cast<uint64_t>(ret) * config.frameSize) >> 10)
+			<< " KiB)";
+
+	return ret;
+}
+
+int PipelineHandlerXISP::start(Camera *camera, const ControlList *controls)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	return data->runInCameraThread([&]() {
+		return startDevice(camera, controls);
+	});
+}
+
+int PipelineHandlerXISP::startDevice(Camera *camera, const ControlList *controls)
+{
+	XISPCameraData *data = cameraData(camera);
+	int ret;
+
+	data->statsPending_ = false;
+	data->algoResults_.reset();
+	data->lastFrameStart_.reset();
+	data->lastFrame_.reset();
+	data->frameStarts_.clear();
+
+	/* Apply the initial controls before streaming starts. */
+	if (controls) {
+		ControlList initial = *controls;
+		data->applyAlgorithmControls(&initial);
+		data->setHdrMode(initial);
+
+		if (!data->reprocessing()) {
+			ControlList ctrls = data->sensorControls(initial);
+			ret = data->camSensor_->setControls(&ctrls);
+			if (ret)
+				return ret;
+
+			ret = data->setLensControls(*controls);
+			if (ret)
+				return ret;
+		}
+
+		const auto &crop = controls->get(controls::ScalerCrop);
+		if (crop && data->scalerCropEnabled()) {
+			ret = data->setScalerCrop(*crop);
+			if (ret)
+				return ret;
+		}
+	}
+
+	data->hdrChannels_.fill(controls::HdrChannelNone);
+	data->hdrQueueCount_ = 1;
+	data->scalerCrops_.fill(data->scalerCrop_);
+	data->cropQueueCount_ = 1;
+	if (data->controlInfo_.count(&controls::HdrMode)) {
+		const std::vector<uint32_t> ids = { V4L2_CID_EXPOSURE };
+		ControlList ctrls = data->camSensor_->getControls(ids);
+		data->hdrLongExposure_ = ctrls.get(V4L2_CID_EXPOSURE).get<int32_t>();
+	}
+
+	if (!data->reprocessing()) {
+		data->delayedCtrls_->reset();
+		data->frameStartEnabled_ = !data->csi2rx_->setFrameStartEnabled(true);
+	} else {
+		data->frameStartEnabled_ = false;
+	}
+
+	if (data->ispRedGain_)
+		data->queueColourGains({ 1.0f, 1.0f });
+	if (controls)
+		data->queueIspControls(*controls);
+
+	ret = data->applyIspControls();
+	if (ret)
+		return ret;
+
+	data->resetStats();
+
+	for (const auto &stream : data->enabledStreams_) {
+		Pipe *pipe = pipeFromStream(camera, stream);
+		const StreamConfiguration &config = stream->configuration();
+
+		/*
+		 * Buffers are always queued in DMABUF mode, both when exported
+		 * by exportFrameBuffers() and when wrapping dmabufs allocated
+		 * by another device. Import enough slots for the hot buffer
+		 * cache to avoid re-importing a dmabuf each time it is queued.
+		 */
+		if (data->latestFrame_ && pipe->spares.empty() && !pipe->input) {
+			ret = allocateSpareBuffers(data, pipe);
+			if (ret)
+				return ret;
+		}
+
+		unsigned int count = std::max<unsigned int>(config.bufferCount + pipe->spares.size(),
+							    kNumImportSlots);
+
+		/* Slots kept by a warm stop are reused as long as they suffice. */
+		if (pipe->importedBuffers < count) {
+			data->releaseBuffers(pipe);
+
+			LOG(XISP, Debug) << "  [importBuffers] : " << count;
+
+			ret = pipe->capture->importBuffers(count);
+			if (ret)
+				return ret;
+
+			pipe->importedBuffers = count;
+		}
+
+		ret = pipe->capture->streamOn();
+		if (ret)
+			return ret;
+
+		/* No request has been queued yet, start on the spare buffers. */
+		while (!pipe->freeSpares.empty()) {
+			ret = pipe->capture->queueBuffer(pipe->freeSpares.back());
+			if (ret)
+				return ret;
+
+			pipe->freeSpares.pop_back();
+			pipe->stats.queued++;
+		}
+	}
+
+	/*
+	 * The algorithms are configured before their thread is started. No
+	 * statistics can be posted before this function returns.
+	 */
+	data->algo_->configure(data->algoConfig());
+	data->algoThread_.start();
+	data->running_ = true;
+
+	return 0;
+}
+
+void PipelineHandlerXISP::stopDevice(Camera *camera)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	/*
+	 * Requests completing from now on can't be matched anymore, and the
+	 * held requests are queued as they are, the ones of this camera are
+	 * then cancelled by stopping the streams.
+	 */
+	data->running_ = false;
+	if (data->syncMember_) {
+		queueSyncGroup();
+		matchSyncGroup();
+	}
+
+	data->runInCameraThread([&]() {
+		stopStreams(camera);
+		return 0;
+	});
+
+	/*
+	 * All requests must be completed when this function returns, deliver
+	 * the completions handed over by the camera thread.
+	 */
+	if (data->worker_)
+		Thread::current()->dispatchMessages(Message::Type::InvokeMessage, this);
+}
+
+void PipelineHandlerXISP::stopStreams(Camera *camera)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	for (const auto &stream : data->enabledStreams_) {
+		Pipe *pipe = pipeFromStream(camera, stream);
+
+		pipe->capture->streamOff();
+		if (!data->warmStop_) {
+			data->releaseBuffers(pipe);
+			releaseSpareBuffers(pipe);
+		}
+
+		/* Return the buffers held back from the video node. */
+		while (!pipe->pendingBuffers.empty()) {
+			FrameBuffer *buffer = pipe->pendingBuffers.front();
+			pipe->pendingBuffers.pop_front();
+
+			buffer->_d()->cancel();
+			completeRequestBuffer(data, buffer->request(), buffer);
+		}
+
+		/* Applications may free their buffers once stopped. */
+		pipe->mappedBuffers.clear();
+	}
+
+	data->algoThread_.exit();
+	data->algoThread_.wait();
+
+	if (data->frameStartEnabled_)
+		data->csi2rx_->setFrameStartEnabled(false);
+
+	data->logStats();
+}
+
+int PipelineHandlerXISP::queueRequestDevice(Camera *camera, Request *request)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	/* Outputs are only produced from the frame fed on the input stream. */
+	if (data->reprocessing() && !request->findBuffer(data->rawStream())) {
+		LOG(XISP, Error) << "Request " << request->sequence()
+				 << " has no input buffer";
+		return -EINVAL;
+	}
+
+	/*
+	 * The requests of the sync group members are queued together, for
+	 * the cameras to capture them from the same frames.
+	 */
+	if (data->syncMember_ && syncGroupRunning()) {
+		data->syncRequests_.push_back(request);
+		queueSyncGroup();
+		return 0;
+	}
+
+	if (data->worker_) {
+		queueHeldRequest(data, request);
+		return 0;
+	}
+
+	int ret = queueRequestControls(camera, request);
+	if (ret)
+		return ret;
+
+	for (const auto &[stream, buffer] : request->buffers()) {
+		ret = queueRequestBuffer(camera, request, stream, buffer);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue a request in the camera thread, or held for the sync group. Errors
+ * can't be reported to the caller anymore, the buffers that can't be queued
+ * complete as cancelled.
+ */
+void PipelineHandlerXISP::queueCameraRequest(Camera *camera, Request *request)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	if (data->worker_)
+		data->pendingRequests_[request] = request->buffers().size();
+
+	int ret = queueRequestControls(camera, request);
+
+	for (const auto &[stream, buffer] : request->buffers()) {
+		if (!ret)
+			ret = queueRequestBuffer(camera, request, stream, buffer);
+		if (!ret)
+			continue;
+
+		buffer->_d()->cancel();
+		completeRequestBuffer(data, request, buffer);
+	}
+
+	if (ret)
+		LOG(XISP, Error) << "Failed to queue request " << request->sequence()
+				 << ": " << ret;
+}
+
+int PipelineHandlerXISP::queueRequestControls(Camera *camera, Request *request)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	/*
+	 * Queue the sensor controls for the frame of this request, one entry
+	 * per request, even when the request carries no sensor control.
+	 */
+	ControlList controls = request->controls();
+	data->applyAlgorithmControls(&controls);
+	data->setHdrMode(controls);
+
+	data->queueIspControls(request->controls());
+
+	if (data->reprocessing())
+		return 0;
+
+	data->pushSensorControls(controls);
+
+	int ret = data->setLensControls(request->controls());
+	if (ret)
+		return ret;
+
+	data->queueScalerCrop(request->controls());
+
+	return 0;
 }
 
-int PipelineHandlerXISP::start(Camera *camera,
-			      [[maybe_unused]] const ControlList *controls)
+int PipelineHandlerXISP::queueRequestBuffer(Camera *camera, Request *request,
+					    const Stream *stream,
+					    FrameBuffer *buffer)
 {
 	XISPCameraData *data = cameraData(camera);
+	Pipe *pipe = pipeFromStream(camera, stream);
+	int ret;
 
-	for (const auto &stream : data->enabledStreams_) {
-		Pipe *pipe = pipeFromStream(camera, stream);
-		const StreamConfiguration &config = stream->configuration();
+	XISP_TRACEPOINT(queue_buffer, data->index_, data->pipeIndex(stream),
+			request->sequence(), buffer);
 
-		int ret = pipe->capture->importBuffers(config.bufferCount);
-		if (ret)
-			return ret;
+	/* The ISP reads the whole input frame. */
+	if (pipe->input) {
+		FrameMetadata &metadata = buffer->_d()->metadata();
+		for (const auto &[p, plane] : utils::enumerate(buffer->planes()))
+			metadata.planes()[p].bytesused = plane.length;
+	}
 
-		ret = pipe->capture->streamOn();
-		if (ret)
-			return ret;
+	if (!pipe->spares.empty()) {
+		pipe->pendingBuffers.push_back(buffer);
+		ret = queueLatestFrameBuffers(data, pipe);
+	} else {
+		ret = pipe->capture->queueBuffer(buffer);
+		if (!ret) {
+			pipe->queueTimes.push(utils::clock::now());
+			pipe->stats.queued++;
+		}
 	}
 
-	return 0;
+	return ret;
 }
 
-void PipelineHandlerXISP::stopDevice(Camera *camera)
+/*
+ * Keep the video node of a pipe fed in latest frame mode. The oldest pending
+ * application buffer is queued as soon as no other one is, to receive the
+ * frame following the ones in flight. Spare buffers then top the queue up
+ * to kLatestFrameDepth buffers, also when the application buffer can't be
+ * queued, for the DMA never to run out of buffers while the application
+ * requeues. An application buffer thus waits behind two spare buffers at
+ * most, and behind one while the application keeps requeueing.
+ *
+ * libcamera requests carry the application buffers, a frame captured to a
+ * spare buffer can't be handed to a request without a copy. The frames
+ * captured to the spare buffers are only used by the 3A.
+ */
+int PipelineHandlerXISP::queueLatestFrameBuffers(XISPCameraData *data, Pipe *pipe)
 {
-	XISPCameraData *data = cameraData(camera);
+	if (!data->running_)
+		return 0;
+
+	int ret = 0;
+
+	if (!pipe->bufferQueued && !pipe->pendingBuffers.empty()) {
+		FrameBuffer *buffer = pipe->pendingBuffers.front();
+		ret = pipe->capture->queueBuffer(buffer);
+		if (!ret) {
+			pipe->pendingBuffers.pop_front();
+			pipe->bufferQueued = true;
+			pipe->queueTimes.push(utils::clock::now());
+			pipe->stats.queued++;
+		}
+	}
 
-	for (const auto &stream : data->enabledStreams_) {
-		Pipe *pipe = pipeFromStream(camera, stream);
+	while (pipe->stats.queued < kLatestFrameDepth && !pipe->freeSpares.empty()) {
+		int err = pipe->capture->queueBuffer(pipe->freeSpares.back());
+		if (err) {
+			ret = err;
+			break;
+		}
 
-		pipe->capture->streamOff();
-		pipe->capture->releaseBuffers();
+		pipe->freeSpares.pop_back();
+		pipe->stats.queued++;
 	}
+
+	return ret;
 }
 
-int PipelineHandlerXISP::queueRequestDevice(Camera *camera, Request *request)
+int PipelineHandlerXISP::allocateSpareBuffers(XISPCameraData *data, Pipe *pipe)
 {
-	for (auto &[stream, buffer] : request->buffers()) {
-		Pipe *pipe = pipeFromStream(camera, stream);
+	/* Buffers are exported in MMAP mode, with no DMABUF slot allocated. */
+	data->releaseBuffers(pipe);
 
-		int ret = pipe->capture->queueBuffer(buffer);
-		if (ret)
-			return ret;
+	int ret = pipe->capture->exportBuffers(kLatestFrameDepth, &pipe->spares);
+	if (ret < 0)
+		return ret;
+
+	/* The spare buffers have no request, the cookie points to their camera. */
+	for (const auto &spare : pipe->spares) {
+		spare->setCookie(reinterpret_cast<uintptr_t>(data));
+		pipe->freeSpares.push_back(spare.get());
 	}
 
 	return 0;
 }
 
+void PipelineHandlerXISP::releaseSpareBuffers(Pipe *pipe)
+{
+	pipe->freeSpares.clear();
+	pipe->spares.clear();
+}
+
 bool PipelineHandlerXISP::match(DeviceEnumerator *enumerator)
 {
   // Additional context to what is being searched
@@ -584,153 +3228,254 @@ bool PipelineHandlerXISP::match(DeviceEnumerator *enumerator)
   //   V4l2Subdevice = "a00b0000.ISPPipeline_accel"
   //   V4l2Subdevice = "a0180000.v_proc_ss"
 
-  LOG(XISP, Debug) << "[PipelineHandlerXISP::match] Looking for capture pipeline";  
-	for (unsigned int i = 0; i < 4; i++) {
+  LOG(XISP, Debug) << "[PipelineHandlerXISP::match] Looking for capture pipelines";  
+
+	/*
+	 * Each capture pipeline is exposed by the xilinx-video driver as a
+	 * separate media device. Acquire all of them from a single handler
+	 * instance and register one camera per pipeline.
+	 */
+	std::vector<std::pair<MediaDevice *, unsigned int>> pipelines;
+	unsigned int numCameras = 0;
+	utils::time_point begin = utils::clock::now();
+
+	for (unsigned int i = 0; i < kMaxPipelines; i++) {
 		std::string entityName = "vcap_mipi_" + std::to_string(i) + "_v_proc output 0";
+		MediaDevice *media = nullptr;
 
-    DeviceMatch dm("xilinx-video"); // driver
-	  dm.add(entityName); // entity
+		for (const char *driver : xispDrivers) {
+			DeviceMatch dm(driver);
+			dm.add(entityName); // entity
 
-    mediaDev_ = acquireMediaDevice(enumerator, dm);
-    if (mediaDev_) {
-      LOG(XISP, Debug) << "  Found pipeline ... ";  
-      break;
-    }
-	  if (!mediaDev_) {
-		  continue;
-    }
-  }
-  if (!mediaDev_) {
-    LOG(XISP, Debug) << "  Done ...";  
-    return false;
-  }
-    
-  int ret;
+			media = acquireMediaDevice(enumerator, dm);
+			if (media)
+				break;
+		}
+
+		if (!media)
+			continue;
+
+		LOG(XISP, Debug) << "  Found pipeline " << i << " ... ";
+		pipelines.emplace_back(media, i);
+	}
+
+	/* The cameras share the resources of all the pipelines found. */
+	for (const auto &[media, index] : pipelines) {
+		if (createCamera(media, index, pipelines.size()))
+			numCameras++;
+	}
+
+	utils::duration elapsed = utils::clock::now() - begin;
+	LOG(XISP, Info) << "Registered " << numCameras << " cameras in "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+			<< " ms";
+
+	return numCameras > 0;
+}
+
+bool PipelineHandlerXISP::createCamera(MediaDevice *media, unsigned int index,
+				       unsigned int numPipelines)
+{
+	int ret;
+
+	/* Create the camera data. */
+	std::unique_ptr<XISPCameraData> data =
+		std::make_unique<XISPCameraData>(this, media, index);
+
+	if (cameraThreads_) {
+		std::optional<unsigned int> cpu;
+		if (!cameraCpus_.empty())
+			cpu = cameraCpus_[index % cameraCpus_.size()];
+
+		data->startCameraThread(cpu);
+	}
 
   MediaEntity *sensor_entity = NULL;
-	std::unique_ptr<V4L2Subdevice> resizer = NULL;
- 	std::unique_ptr<V4L2VideoDevice> capture = NULL;
+	std::vector<MediaEntity *> captureEntities;
    
   // Scan for entities in capture pipeline 
-  //for (const MediaEntity *entity : mediaDev_->entities()) {
-  for ( MediaEntity *entity : mediaDev_->entities()) {
+  for ( MediaEntity *entity : media->entities()) {
 	  if ( entity->name().find("imx") != std::string::npos ) {
       sensor_entity = entity;      
       LOG(XISP, Debug) << "  [CAM ] : " << entity->name();  
-      if ( entity->name().find("imx219") != std::string::npos ) {
-        sensorBestSize_.width = 1920;     
-        sensorBestSize_.height = 1080; 
-        sensorBestFormatCode_ = MEDIA_BUS_FMT_SRGGB10_1X10;       
-        LOG(XISP, Debug) << "    [IMX219] : " << sensorBestSize_.width << "x" << sensorBestSize_.height << "-SRGGB10_1X10";  
-        //sensorBestColorSpace_ = ColorSpace::Srgb;
-      }   
-      if ( entity->name().find("imx708") != std::string::npos ) {
-        sensorBestSize_.width = 1536;     
-        sensorBestSize_.height = 864;         
-        sensorBestFormatCode_ = MEDIA_BUS_FMT_SRGGB10_1X10;       
-        LOG(XISP, Debug) << "    [IMX708] : " << sensorBestSize_.width << "x" << sensorBestSize_.height << "-SRGGB10_1X10";  
-        //sensorBestColorSpace_ = ColorSpace::Srgb;
-      }   
-      if ( entity->name().find("imx477") != std::string::npos ) {
-        sensorBestSize_.width = 1332;     
-        sensorBestSize_.height = 990;         
-        sensorBestFormatCode_ = MEDIA_BUS_FMT_SRGGB10_1X10;       
-        LOG(XISP, Debug) << "    [IMX477] : " << sensorBestSize_.width << "x" << sensorBestSize_.height << "-SRGGB10_1X10";
-        //sensorBestColorSpace_ = ColorSpace::Srgb;
-      }   
-      if ( entity->name().find("imx500") != std::string::npos ) {
-        sensorBestSize_.width = 2028;     
-        sensorBestSize_.height = 1520;         
-        sensorBestFormatCode_ = MEDIA_BUS_FMT_SRGGB10_1X10;       
-        LOG(XISP, Debug) << "    [IMX500] : " << sensorBestSize_.width << "x" << sensorBestSize_.height << "-SRGGB10_1X10";  
-        //sensorBestColorSpace_ = ColorSpace::Srgb;
-      }   
-      sensor_ = V4L2Subdevice::fromEntityName(mediaDev_, entity->name());
     }
 	  if ( entity->name().find("dw9807") != std::string::npos ) {
       LOG(XISP, Debug) << "  [VCM ] : " << entity->name();         
-      vcm_ = V4L2Subdevice::fromEntityName(mediaDev_, entity->name());        
+      data->vcm_ = V4L2Subdevice::fromEntityName(media, entity->name());        
     }
 	  if ( entity->name().find("mipi_csi2_rx_subsystem") != std::string::npos ) {
       LOG(XISP, Debug) << "  [CSI ] : " << entity->name();           
-      csi2rx_ = V4L2Subdevice::fromEntityName(mediaDev_, entity->name());
-      //csi2rx_entity = entity;        
-    }
-	  if ( entity->name().find("ISPPipeline_accel") != std::string::npos ) {
-      LOG(XISP, Debug) << "  [XISP] : " << entity->name();
-      xisp_ = V4L2Subdevice::fromEntityName(mediaDev_, entity->name());        
-    }
-	  if ( entity->name().find("v_proc_ss") != std::string::npos ) {
-      LOG(XISP, Debug) << "  [VPSS] : " << entity->name();
-      resizer = V4L2Subdevice::fromEntityName(mediaDev_, entity->name());  
+      data->csi2rx_ = V4L2Subdevice::fromEntityName(media, entity->name());
     }
+	  for (const XISPBackend &backend : xispBackends) {
+		if (entity->name().find(backendEntities_.at(backend.name)) == std::string::npos)
+			continue;
+
+		LOG(XISP, Debug) << "  [XISP] : " << entity->name()
+				 << " (" << backend.name << ")";
+		data->xisp_ = V4L2Subdevice::fromEntityName(media, entity->name());
+		data->backend_ = &backend;
+	  }
 	  if ( entity->name().find("vcap_mipi_") != std::string::npos ) {
       LOG(XISP, Debug) << "  [VCAP] : " << entity->name();  
-  		capture = V4L2VideoDevice::fromEntityName(mediaDev_, entity->name());
+			captureEntities.push_back(entity);
     }
   }
 
-	if (!csi2rx_)
+	if (!sensor_entity)
+		return false;
+
+	if (sensor_entity->function() != MEDIA_ENT_F_CAM_SENSOR) {
+		LOG(XISP, Debug) << "Skip unsupported subdevice "
+				<< sensor_entity->name();
+		return false;
+	}
+
+	if (!data->csi2rx_)
 	  return false;
-	ret = csi2rx_->open();
+	ret = data->runInCameraThread([&]() { return data->csi2rx_->open(); });
 	if (ret)
 		return false;
   
-	if (!xisp_)
+	if (!data->xisp_)
 	  return false;
-	ret = xisp_->open();
+	ret = data->xisp_->open();
 	if (ret)
 		return false;
 
-  if (!resizer)
-    return false;
+	data->maxSize_ = data->backend_->maxSize.boundedTo(kMaxVpssSize);
 
-	ret = resizer->open();
-	if (ret)
-		return false;
-        
-	if (!capture)
-		return false;
+	/*
+	 * Create one pipe per video node. Each video node is fed by its own
+	 * v_proc_ss instance, all of them sharing the same ISP
+	 * output. A video node fed by the csi2rx directly, when the bitstream
+	 * routes the raw stream to memory, is the raw pipe.
+	 */
+	MediaEntity *rawEntity = nullptr;
+
+	for (MediaEntity *entity : captureEntities) {
+		const MediaPad *sink = entity->getPadByIndex(0);
+		if (!sink || sink->links().empty())
+			continue;
+
+		MediaEntity *vpss = sink->links()[0]->source()->entity();
+		if (vpss == data->csi2rx_->entity()) {
+			LOG(XISP, Debug) << "  [RAW ] : " << entity->name();
+			if (!rawEntity)
+				rawEntity = entity;
+			continue;
+		}
 
-	capture->bufferReady.connect(this, &PipelineHandlerXISP::bufferReady);
+		if (vpss->name().find("v_proc_ss") == std::string::npos) {
+			LOG(XISP, Debug) << "Skip video node " << entity->name()
+					 << " not fed by a v_proc_ss instance";
+			continue;
+		}
 
-	ret = capture->open();
-	if (ret)
-		return ret;
+		LOG(XISP, Debug) << "  [PIPE] : " << vpss->name()
+				 << " -> " << entity->name();
+
+		Pipe pipe;
+
+		pipe.resizer = std::make_unique<V4L2Subdevice>(vpss);
+		ret = pipe.resizer->open();
+		if (ret)
+			return false;
 
-	pipes_.push_back({ std::move(resizer), std::move(capture) });
+		ret = openCapture(data.get(), &pipe, entity);
+		if (ret)
+			return false;
+
+		data->pipes_.push_back(std::move(pipe));
+	}
 
-	if (pipes_.empty()) {
+	if (data->pipes_.empty()) {
 		LOG(XISP, Error) << "Unable to enumerate pipes";
 		return false;
 	}
 
-	if (sensor_entity->function() != MEDIA_ENT_F_CAM_SENSOR) {
-		LOG(XISP, Debug) << "Skip unsupported subdevice "
-				<< sensor_entity->name();
-		return false;
+	/*
+	 * A video node reading Bayer frames from memory can feed the ISP in
+	 * place of the csi2rx. Requests then carry a frame in their buffer of
+	 * the input stream, processed by the ISP to their other buffers, with
+	 * the sensor left idle. Bitstreams routing the csi2rx output to a
+	 * video node keep it as the raw pipe.
+	 */
+	MediaEntity *inputEntity = nullptr;
+	for (MediaEntity *entity : media->entities()) {
+		const MediaPad *source = entity->getPadByIndex(0);
+		if (entity->function() != MEDIA_ENT_F_IO_V4L || !source ||
+		    !(source->flags() & MEDIA_PAD_FL_SOURCE))
+			continue;
+
+		for (const MediaLink *link : source->links()) {
+			if (link->sink()->entity() == data->xisp_->entity())
+				inputEntity = entity;
+		}
 	}
 
-	/* Create the camera data. */
-	std::unique_ptr<XISPCameraData> data =
-		std::make_unique<XISPCameraData>(this);
+	if (inputEntity)
+		LOG(XISP, Debug) << "  [IN  ] : " << inputEntity->name();
 
-#if 0 // 0.3.2 implementation
-	data->camSensor_ = std::make_unique<CameraSensor>(sensor_entity);
-#else // 0.4.0 implementation
-	data->camSensor_ = CameraSensorFactoryBase::create(sensor_entity);
-#endif
-	//data->csi2rx_ = std::make_unique<V4L2Subdevice>(csi2rx_entity);
+	/* Kept even when unused, to disable its link to the ISP sink. */
+	data->inputEntity_ = inputEntity;
+
+	MediaEntity *rawNode = rawEntity ? rawEntity : inputEntity;
+	if (rawNode) {
+		Pipe pipe;
 
-	ret = data->init();
+		pipe.input = rawNode == inputEntity;
+		ret = openCapture(data.get(), &pipe, rawNode);
+		if (ret)
+			return false;
+
+		/* Keep the Bayer formats the video node can write or read. */
+		V4L2VideoDevice::Formats formats = pipe.capture->formats();
+		for (const PixelFormat &format : { formats::SRGGB10, formats::SRGGB10_CSI2P }) {
+			if (formats.count(pipe.capture->toV4L2PixelFormat(format)))
+				data->rawFormats_.push_back(format);
+		}
+
+		if (!data->rawFormats_.empty()) {
+			data->rawPipe_ = data->pipes_.size();
+			data->pipes_.push_back(std::move(pipe));
+		} else {
+			LOG(XISP, Warning) << "No raw Bayer format on " << rawNode->name();
+		}
+	}
+
+	/* One stream per pipe. */
+	data->streams_.resize(data->pipes_.size());
+
+	/* The sensor itself is only probed when the camera is first used. */
+	data->sensorEntity_ = sensor_entity;
+
+	ret = data->init(numPipelines);
 	if (ret) {
 		LOG(XISP, Error) << "Failed to initialize camera data";
 		return false;
 	}
 
+	XISPCameraData *cameraData = data.get();
+	data->csi2rx_->frameStart.connect(data->eventReceiver(), [cameraData](uint32_t sequence) {
+		cameraData->frameStarted(sequence);
+	});
+
+	/* The results are delivered in the thread driving the camera. */
+	data->algo_->resultsReady.connect(data->eventReceiver(), [cameraData](const XISP3AResults &results) {
+		cameraData->algoResultsReady(results);
+	});
+
 	/* Register the camera. */
   LOG(XISP, Debug) << "Register the camera ...";
-	const std::string &id = data->camSensor_->id();
+	/*
+	 * Build the camera id the way CameraSensor does, from the sensor
+	 * firmware node, without opening the sensor.
+	 */
+	std::string devicePath = V4L2Subdevice(sensor_entity).devicePath();
+	std::string id = sysfs::firmwareNodePath(devicePath);
+	if (id.empty())
+		id = devicePath;
   LOG(XISP, Debug) << "  [id] : " << id;
 	std::set<Stream *> streams;
 	std::transform(data->streams_.begin(), data->streams_.end(),
@@ -738,6 +3483,11 @@ bool PipelineHandlerXISP::match(DeviceEnumerator *enumerator)
 		       [](Stream &s) { return &s; });
 	LOG(XISP, Debug) << "  [streams.size()] : " << streams.size();
 
+	if (syncIds_.count(id)) {
+		data->syncMember_ = true;
+		syncGroup_.push_back(data.get());
+	}
+
 	std::shared_ptr<Camera> camera =
 		Camera::create(std::move(data), id, streams);
 
@@ -746,38 +3496,451 @@ bool PipelineHandlerXISP::match(DeviceEnumerator *enumerator)
   return true;
 }
 
+/*
+ * Create and open the video node of a pipe. With camera threads, the video
+ * node is created in the camera thread, its buffers are then queued and
+ * dequeued there.
+ */
+int PipelineHandlerXISP::openCapture(XISPCameraData *data, Pipe *pipe,
+				     MediaEntity *entity)
+{
+	return data->runInCameraThread([&]() {
+		pipe->capture = std::make_unique<V4L2VideoDevice>(entity);
+		pipe->capture->bufferReady.connect(data->eventReceiver(),
+						   [this](FrameBuffer *buffer) {
+							   bufferReady(buffer);
+						   });
+
+		return pipe->capture->open();
+	});
+}
+
 PipelineHandlerXISP::Pipe *PipelineHandlerXISP::pipeFromStream(Camera *camera,
 							     const Stream *stream)
 {
-  //LOG(XISP, Debug) << "[pipeFromStream]";
-  
 	XISPCameraData *data = cameraData(camera);
 	unsigned int pipeIndex = data->pipeIndex(stream);
-	//LOG(XISP, Debug) << "  [pipeIndex] : " << pipeIndex;
 
-	//ASSERT(pipeIndex < pipes_.size());
-  // always 0 ... correct ... 
+	ASSERT(pipeIndex < data->pipes_.size());
+
+	return &data->pipes_[pipeIndex];
+}
+
+void PipelineHandlerXISP::updateStats(XISPCameraData *data, Pipe *pipe,
+				      const FrameBuffer *buffer)
+{
+	XISPCameraData::FrameStats &stats = pipe->stats;
+	const FrameMetadata &info = buffer->metadata();
+	uint64_t ns = 0;
+
+	/* Buffers complete in the order they have been queued. */
+	if (!pipe->queueTimes.empty()) {
+		utils::duration latency = utils::clock::now() - pipe->queueTimes.front();
+		pipe->queueTimes.pop();
+
+		if (info.status != FrameMetadata::FrameCancelled) {
+			ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+			stats.latencySum += ns;
+			stats.latencyMax = std::max(stats.latencyMax, ns);
+		}
+	}
+
+	stats.queued--;
+
+	switch (info.status) {
+	case FrameMetadata::FrameSuccess:
+		stats.frames++;
+		break;
+	case FrameMetadata::FrameError:
+		stats.errors++;
+		break;
+	case FrameMetadata::FrameCancelled:
+		stats.cancelled++;
+		return;
+	}
 
-	return &pipes_[pipeIndex];
+	/*
+	 * The buffer sequence is the sensor frame number, see frameSequence(),
+	 * a gap means frames the stream hasn't been captured for.
+	 */
+	if (stats.lastSequence && info.sequence > *stats.lastSequence + 1)
+		stats.dropped += info.sequence - *stats.lastSequence - 1;
+	stats.lastSequence = info.sequence;
+
+	/* With no buffer left in the queue the DMA will drop the next frame. */
+	if (!stats.queued)
+		stats.underruns++;
+
+	/* Reported in the request metadata, see fillRequestMetadata(). */
+	XISPCameraData::RequestStats &request = data->requestStats_[buffer->request()];
+	request.latency = std::max(request.latency, ns);
+	request.depth = std::min(request.depth.value_or(stats.queued), stats.queued);
 }
 
 void PipelineHandlerXISP::bufferReady(FrameBuffer *buffer)
 {
 	Request *request = buffer->request();
+	if (!request) {
+		spareBufferReady(buffer);
+		return;
+	}
+
+	Camera *camera = request->_d()->camera();
+	XISPCameraData *data = cameraData(camera);
+
+	for (const auto &[stream, streamBuffer] : request->buffers()) {
+		if (streamBuffer != buffer)
+			continue;
+
+		Pipe *pipe = pipeFromStream(camera, stream);
+
+		/* Number the buffer after the sensor frame it has been captured from. */
+		FrameMetadata &metadata = buffer->_d()->metadata();
+		if (metadata.status != FrameMetadata::FrameCancelled &&
+		    !data->reprocessing())
+			metadata.sequence = data->frameSequence(metadata.timestamp);
+
+		XISP_TRACEPOINT(buffer_ready, data->index_, data->pipeIndex(stream),
+				request->sequence(), buffer,
+				buffer->metadata().sequence,
+				buffer->metadata().timestamp,
+				buffer->metadata().status);
+
+		updateStats(data, pipe, buffer);
+
+		if (pipe->bufferQueued) {
+			pipe->bufferQueued = false;
+			if (queueLatestFrameBuffers(data, pipe))
+				LOG(XISP, Error) << "Failed to queue buffer";
+		}
+
+		if (buffer->metadata().status != FrameMetadata::FrameCancelled &&
+		    !pipe->input)
+			data->frameCompleted(buffer->metadata().sequence);
+
+		if (data->statsPipe_ == data->pipeIndex(stream) && !data->statsPending_ &&
+		    (data->aeEnabled_ || data->awbEnabled_) &&
+		    buffer->metadata().status == FrameMetadata::FrameSuccess)
+			data->collectStatistics(pipe, buffer);
+
+		const XISPCameraData::FrameStats &stats = pipe->stats;
+		LOG(XISPStats, Debug)
+			<< "Stream " << data->pipeIndex(stream)
+			<< " sequence " << buffer->metadata().sequence
+			<< " status " << buffer->metadata().status
+			<< " queued " << stats.queued
+			<< " dropped " << stats.dropped;
+
+		if (data->statsInterval_ && stats.frames &&
+		    !(stats.frames % data->statsInterval_) &&
+		    buffer->metadata().status == FrameMetadata::FrameSuccess)
+			data->logStats();
+		break;
+	}
+
+	completeRequestBuffer(data, request, buffer);
+}
+
+/*
+ * A frame captured to a spare buffer of a pipe in latest frame mode. It is
+ * used by the 3A like any other frame. The spare buffer is queued again only
+ * when the video node queue is below kLatestFrameDepth, it would otherwise
+ * take frames from the application.
+ */
+void PipelineHandlerXISP::spareBufferReady(FrameBuffer *buffer)
+{
+	XISPCameraData *data = reinterpret_cast<XISPCameraData *>(buffer->cookie());
+	FrameMetadata &info = buffer->_d()->metadata();
+
+	auto pipe = std::find_if(data->pipes_.begin(), data->pipes_.end(),
+				 [buffer](const Pipe &p) {
+					 return std::any_of(p.spares.begin(), p.spares.end(),
+							    [buffer](const auto &spare) {
+								    return spare.get() == buffer;
+							    });
+				 });
+	if (pipe == data->pipes_.end())
+		return;
+
+	unsigned int index = pipe - data->pipes_.begin();
+
+	pipe->stats.queued--;
+	pipe->freeSpares.push_back(buffer);
+	if (info.status == FrameMetadata::FrameCancelled)
+		return;
+
+	info.sequence = data->frameSequence(info.timestamp);
+
+	/* Frames captured to the spare buffer are not reported as dropped. */
+	if (info.status == FrameMetadata::FrameSuccess)
+		pipe->stats.lastSequence = info.sequence;
+
+	data->frameCompleted(info.sequence);
+
+	if (data->statsPipe_ == index && !data->statsPending_ &&
+	    (data->aeEnabled_ || data->awbEnabled_) &&
+	    info.status == FrameMetadata::FrameSuccess)
+		data->collectStatistics(&*pipe, buffer);
+
+	if (queueLatestFrameBuffers(data, &*pipe))
+		LOG(XISP, Error) << "Failed to recycle spare buffer";
+}
+
+void PipelineHandlerXISP::completeRequestBuffer(XISPCameraData *data,
+						Request *request,
+						FrameBuffer *buffer)
+{
+	/*
+	 * In the camera thread, the request metadata is filled along with
+	 * the last buffer, and the completion is queued to the pipeline
+	 * handler thread. The application doesn't access the metadata until
+	 * the request completes, the pipeline handler thread only touches it
+	 * after the last buffer.
+	 */
+	if (data->worker_) {
+		auto it = data->pendingRequests_.find(request);
+		bool last = it == data->pendingRequests_.end() || !--it->second;
+
+		uint64_t timestamp = 0;
+		if (last) {
+			if (it != data->pendingRequests_.end())
+				data->pendingRequests_.erase(it);
+			timestamp = data->fillRequestMetadata(request, &request->metadata());
+		}
 
-	/* Record the sensor's timestamp in the request metadata. */
-	ControlList &metadata = request->metadata();
-	if (!metadata.contains(controls::SensorTimestamp.id()))
-		metadata.set(controls::SensorTimestamp,
-			     buffer->metadata().timestamp);
+		invokeMethod(&PipelineHandlerXISP::completeCameraBuffer,
+			     ConnectionTypeQueued, data, request, buffer, last,
+			     timestamp);
+		return;
+	}
 
 	completeBuffer(request, buffer);
 	if (request->hasPendingBuffers())
 		return;
 
+	uint64_t timestamp = data->fillRequestMetadata(request, &request->metadata());
+
+	XISP_TRACEPOINT(complete_request, data->index_, request->sequence(),
+			buffer->metadata().timestamp);
+
+	completeCameraRequest(data, request, timestamp);
+}
+
+/* Runs in the pipeline handler thread, queued from a camera thread. */
+void PipelineHandlerXISP::completeCameraBuffer(XISPCameraData *data,
+					       Request *request,
+					       FrameBuffer *buffer, bool last,
+					       uint64_t timestamp)
+{
+	completeBuffer(request, buffer);
+	if (!last)
+		return;
+
+	XISP_TRACEPOINT(complete_request, data->index_, request->sequence(),
+			buffer->metadata().timestamp);
+
+	completeCameraRequest(data, request, timestamp);
+}
+
+void PipelineHandlerXISP::completeCameraRequest(XISPCameraData *data,
+						Request *request,
+						uint64_t timestamp)
+{
+	if (data->syncMember_)
+		completeSyncedRequest(data, request, timestamp);
+	else
+		completeRequest(request);
+}
+
+void PipelineHandlerXISP::completeSyncedRequest(XISPCameraData *data,
+						Request *request,
+						uint64_t timestamp)
+{
+	/*
+	 * Requests whose buffers were all cancelled carry no frame to match,
+	 * complete them right away. Completion is delivered to the application
+	 * in queue order regardless.
+	 */
+	if (!timestamp) {
+		completeRequest(request);
+		return;
+	}
+
+	data->syncQueue_.emplace_back(request, timestamp);
+	matchSyncGroup();
+}
+
+/*
+ * Complete the oldest held request of a sync group member without a match.
+ * Its buffers have all completed and are delivered as captured, the frames
+ * captured successfully are flagged with FrameError for applications to tell
+ * them from the matched sets.
+ *
+ * The request isn't requeued to the device to capture another frame in place
+ * of the unmatched one: requests complete to the application in queue order,
+ * all the requests queued after it would be held until the new capture, and
+ * the application would no longer see the drops of the group.
+ */
+void PipelineHandlerXISP::dropSyncedRequest(XISPCameraData *data)
+{
+	Request *request = data->syncQueue_.front().first;
+	data->syncQueue_.pop_front();
+
+	for (const auto &[stream, buffer] : request->buffers()) {
+		FrameMetadata &metadata = buffer->_d()->metadata();
+		if (metadata.status == FrameMetadata::FrameSuccess)
+			metadata.status = FrameMetadata::FrameError;
+	}
+
+	/* The completion statistics belong to the camera thread. */
+	data->runInCameraThread([data]() {
+		data->completionStats_.unmatched++;
+		return 0;
+	}, ConnectionTypeQueued);
+
 	completeRequest(request);
 }
 
+/*
+ * Complete the held requests of the sync group members, in sets of frames
+ * captured within the tolerance. Requests are completed in order for each
+ * camera, a frame older than the newest frame at the head of the other
+ * queues by more than the tolerance can't be matched anymore and is dropped.
+ */
+void PipelineHandlerXISP::matchSyncGroup()
+{
+	/* Without all members streaming, requests complete as they come. */
+	if (!syncGroupRunning()) {
+		for (XISPCameraData *member : syncGroup_) {
+			while (!member->syncQueue_.empty()) {
+				completeRequest(member->syncQueue_.front().first);
+				member->syncQueue_.pop_front();
+			}
+		}
+
+		return;
+	}
+
+	for (;;) {
+		bool ready = true;
+		uint64_t latest = 0;
+
+		for (const XISPCameraData *member : syncGroup_) {
+			if (member->syncQueue_.empty()) {
+				ready = false;
+				break;
+			}
+
+			latest = std::max(latest, member->syncQueue_.front().second);
+		}
+
+		if (!ready)
+			break;
+
+		bool matched = true;
+		for (XISPCameraData *member : syncGroup_) {
+			if (member->syncQueue_.front().second + syncTolerance_ < latest) {
+				dropSyncedRequest(member);
+				matched = false;
+			}
+		}
+
+		if (!matched)
+			continue;
+
+		for (XISPCameraData *member : syncGroup_) {
+			completeRequest(member->syncQueue_.front().first);
+			member->syncQueue_.pop_front();
+		}
+	}
+
+	/*
+	 * Bound the buffers held waiting for a member that dropped frames,
+	 * the oldest frames would be dropped by the next match anyway.
+	 */
+	for (XISPCameraData *member : syncGroup_) {
+		while (member->syncQueue_.size() > kMaxSyncDepth)
+			dropSyncedRequest(member);
+	}
+}
+
+bool PipelineHandlerXISP::syncGroupRunning() const
+{
+	return std::all_of(syncGroup_.begin(), syncGroup_.end(),
+			   [](const XISPCameraData *member) {
+				   return member->running_.load();
+			   });
+}
+
+/* Queue a request deferred from queueRequestDevice(). */
+void PipelineHandlerXISP::queueHeldRequest(XISPCameraData *data, Request *request)
+{
+	Camera *camera = request->_d()->camera();
+
+	data->runInCameraThread([this, camera, request]() {
+		queueCameraRequest(camera, request);
+		return 0;
+	}, ConnectionTypeQueued);
+}
+
+/*
+ * Queue the oldest held request of every sync group member together, once
+ * all the members have one. Without all members streaming, the held requests
+ * are queued as they are.
+ */
+void PipelineHandlerXISP::queueSyncGroup()
+{
+	if (!syncGroupRunning()) {
+		for (XISPCameraData *member : syncGroup_) {
+			while (!member->syncRequests_.empty()) {
+				queueHeldRequest(member, member->syncRequests_.front());
+				member->syncRequests_.pop_front();
+			}
+		}
+
+		return;
+	}
+
+	while (std::all_of(syncGroup_.begin(), syncGroup_.end(),
+			   [](const XISPCameraData *member) {
+				   return !member->syncRequests_.empty();
+			   })) {
+		for (XISPCameraData *member : syncGroup_) {
+			queueHeldRequest(member, member->syncRequests_.front());
+			member->syncRequests_.pop_front();
+		}
+	}
+}
+
+bool PipelineHandlerXISP::acquireDevice(Camera *camera)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	int ret = data->initSensor(data->maxSize_);
+	if (ret) {
+		LOG(XISP, Error) << "Failed to initialize sensor: " << ret;
+		return false;
+	}
+
+	return true;
+}
+
+void PipelineHandlerXISP::releaseDevice(Camera *camera)
+{
+	XISPCameraData *data = cameraData(camera);
+
+	for (Pipe &pipe : data->pipes_) {
+		data->releaseBuffers(&pipe);
+		releaseSpareBuffers(&pipe);
+	}
+
+	/*
+	 * The media graph can be reconfigured by other users once the camera
+	 * is released, the cached formats can't be trusted anymore.
+	 */
+	data->invalidateFormats();
+}
+
 REGISTER_PIPELINE_HANDLER(PipelineHandlerXISP, "xisp")
 
 } /* namespace libcamera */
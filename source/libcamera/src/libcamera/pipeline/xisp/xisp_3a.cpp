@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2025 - Mario Bergeron <Mario.Bergeron@avnet.com>
+ *
+ * Software AE/AWB for the xisp pipeline handler
+ *
+ * The algorithms run in a thread of their own, fed with statistics gathered
+ * by the pipeline handler on a sparse grid of the processed frames. The HLS
+ * ISP doesn't expose its AEC/AWB histograms to userspace.
+ */
+
+#include "xisp_3a.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <libcamera/base/log.h>
+
+namespace libcamera {
+
+LOG_DECLARE_CATEGORY(XISP)
+
+namespace {
+
+/* Target mean luminance of the processed output, in [0, 1]. */
+constexpr double kAeTarget = 0.4;
+/* Relative luminance error below which the exposure is left untouched. */
+constexpr double kAeTolerance = 0.05;
+/* Fraction of the correction applied per frame, to avoid oscillations. */
+constexpr double kAeSpeed = 0.5;
+/* Maximum exposure change per frame. */
+constexpr double kAeMaxStep = 4.0;
+
+constexpr double kAwbSpeed = 0.3;
+constexpr float kMinColourGain = 0.25f;
+constexpr float kMaxColourGain = 4.0f;
+/* Minimum mean of a channel, in [0, 255], to estimate the white balance. */
+constexpr double kAwbMinMean = 8.0;
+/* Maximum fraction of saturated samples to estimate the white balance. */
+constexpr double kAwbMaxSaturated = 0.25;
+
+} /* namespace */
+
+XISP3A::XISP3A()
+	: config_{}, colourGains_{ 1.0f, 1.0f }
+{
+}
+
+/*
+ * Called with the algorithm thread stopped, when the camera is started.
+ */
+void XISP3A::configure(const XISP3AConfig &config)
+{
+	config_ = config;
+	colourGains_ = { 1.0f, 1.0f };
+}
+
+void XISP3A::process(const XISPStatistics &stats)
+{
+	XISP3AResults results{};
+	results.sequence = stats.sequence;
+
+	if (stats.samples) {
+		if (stats.aeEnabled)
+			processAe(stats, &results);
+		if (stats.awbEnabled)
+			processAwb(stats, &results);
+	}
+
+	/* Always reply, the pipeline handler paces the statistics on it. */
+	resultsReady.emit(results);
+}
+
+void XISP3A::processAe(const XISPStatistics &stats, XISP3AResults *results)
+{
+	if (!config_.maxExposureTime || !stats.exposureTime)
+		return;
+
+	double r = static_cast<double>(stats.sum[0]) / stats.samples;
+	double g = static_cast<double>(stats.sum[1]) / stats.samples;
+	double b = static_cast<double>(stats.sum[2]) / stats.samples;
+	double mean = (0.299 * r + 0.587 * g + 0.114 * b) / 255.0;
+
+	double factor = mean > 0.0 ? kAeTarget / mean : kAeMaxStep;
+	if (std::abs(factor - 1.0) < kAeTolerance)
+		return;
+
+	factor = std::clamp(1.0 + (factor - 1.0) * kAeSpeed,
+			    1.0 / kAeMaxStep, kAeMaxStep);
+
+	/* Favour the exposure time over the gain to limit noise. */
+	double total = stats.exposureTime * stats.analogueGain * factor;
+	double exposure = std::clamp(total,
+				     static_cast<double>(config_.minExposureTime),
+				     static_cast<double>(config_.maxExposureTime));
+	double gain = std::clamp(total / exposure,
+				 static_cast<double>(config_.minAnalogueGain),
+				 static_cast<double>(config_.maxAnalogueGain));
+
+	results->exposureTime = static_cast<int32_t>(exposure);
+	results->analogueGain = static_cast<float>(gain);
+
+	LOG(XISP, Debug) << "  [ae] : frame " << stats.sequence
+			 << " mean " << mean << " exposure " << *results->exposureTime
+			 << " us gain " << *results->analogueGain;
+}
+
+/*
+ * Grey world estimation. The statistics are measured after the ISP white
+ * balance, the gains are therefore refined from the ones last applied.
+ */
+void XISP3A::processAwb(const XISPStatistics &stats, XISP3AResults *results)
+{
+	if (stats.saturated > stats.samples * kAwbMaxSaturated)
+		return;
+
+	double r = static_cast<double>(stats.sum[0]) / stats.samples;
+	double g = static_cast<double>(stats.sum[1]) / stats.samples;
+	double b = static_cast<double>(stats.sum[2]) / stats.samples;
+	if (r < kAwbMinMean || g < kAwbMinMean || b < kAwbMinMean)
+		return;
+
+	auto update = [](float gain, double ratio) {
+		double target = gain * ratio;
+		return std::clamp(static_cast<float>(gain + (target - gain) * kAwbSpeed),
+				  kMinColourGain, kMaxColourGain);
+	};
+
+	colourGains_[0] = update(colourGains_[0], g / r);
+	colourGains_[1] = update(colourGains_[1], g / b);
+
+	results->colourGains = colourGains_;
+
+	LOG(XISP, Debug) << "  [awb] : frame " << stats.sequence
+			 << " gains " << colourGains_[0] << " / " << colourGains_[1];
+}
+
+} /* namespace libcamera */
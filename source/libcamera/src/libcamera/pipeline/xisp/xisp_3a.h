@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2025 - Mario Bergeron <Mario.Bergeron@avnet.com>
+ *
+ * Software AE/AWB for the xisp pipeline handler
+ */
+
+#pragma once
+
+#include <array>
+#include <optional>
+#include <stdint.h>
+
+#include <libcamera/base/object.h>
+#include <libcamera/base/signal.h>
+
+namespace libcamera {
+
+/*
+ * Statistics of a frame, accumulated over a decimated grid of the processed
+ * RGB output, along with the sensor settings the frame was captured with.
+ */
+struct XISPStatistics {
+	uint32_t sequence;
+
+	unsigned int samples;
+	/* Sums of the R, G and B samples. */
+	std::array<uint64_t, 3> sum;
+	/* Number of samples with a saturated component. */
+	unsigned int saturated;
+
+	int32_t exposureTime;
+	float analogueGain;
+
+	bool aeEnabled;
+	bool awbEnabled;
+};
+
+struct XISP3AConfig {
+	int32_t minExposureTime;
+	int32_t maxExposureTime;
+	float minAnalogueGain;
+	float maxAnalogueGain;
+};
+
+struct XISP3AResults {
+	uint32_t sequence;
+
+	std::optional<int32_t> exposureTime;
+	std::optional<float> analogueGain;
+	/* Red and blue gains, relative to the ISP default gains. */
+	std::optional<std::array<float, 2>> colourGains;
+};
+
+class XISP3A : public Object
+{
+public:
+	XISP3A();
+
+	void configure(const XISP3AConfig &config);
+	void process(const XISPStatistics &stats);
+
+	Signal<const XISP3AResults &> resultsReady;
+
+private:
+	void processAe(const XISPStatistics &stats, XISP3AResults *results);
+	void processAwb(const XISPStatistics &stats, XISP3AResults *results);
+
+	XISP3AConfig config_;
+	std::array<float, 2> colourGains_;
+};
+
+} /* namespace libcamera */
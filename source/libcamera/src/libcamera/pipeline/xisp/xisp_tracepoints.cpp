@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2025 - Mario Bergeron <Mario.Bergeron@avnet.com>
+ *
+ * Tracepoints provider for the xisp pipeline handler
+ */
+
+#define TRACEPOINT_CREATE_PROBES
+#define TRACEPOINT_DEFINE
+
+#include "xisp_tracepoints.h"
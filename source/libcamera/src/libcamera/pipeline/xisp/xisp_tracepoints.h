@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2025 - Mario Bergeron <Mario.Bergeron@avnet.com>
+ *
+ * Tracepoints for the xisp pipeline handler data path
+ */
+
+#if HAVE_TRACING
+
+#undef TRACEPOINT_PROVIDER
+#define TRACEPOINT_PROVIDER libcamera_xisp
+
+#undef TRACEPOINT_INCLUDE
+#define TRACEPOINT_INCLUDE "pipeline/xisp/xisp_tracepoints.h"
+
+#if !defined(XISP_TRACEPOINTS_H) || defined(TRACEPOINT_HEADER_MULTI_READ)
+#define XISP_TRACEPOINTS_H
+
+#include <lttng/tracepoint.h>
+
+/* A buffer is queued to the video node of a stream. */
+TRACEPOINT_EVENT(
+	libcamera_xisp,
+	queue_buffer,
+	TP_ARGS(
+		unsigned int, pipeline,
+		unsigned int, stream,
+		uint32_t, request,
+		const void *, buffer
+	),
+	TP_FIELDS(
+		ctf_integer(unsigned int, pipeline, pipeline)
+		ctf_integer(unsigned int, stream, stream)
+		ctf_integer(uint32_t, request, request)
+		ctf_integer_hex(uintptr_t, buffer, reinterpret_cast<uintptr_t>(buffer))
+	)
+)
+
+/* A buffer is dequeued from the video node of a stream. */
+TRACEPOINT_EVENT(
+	libcamera_xisp,
+	buffer_ready,
+	TP_ARGS(
+		unsigned int, pipeline,
+		unsigned int, stream,
+		uint32_t, request,
+		const void *, buffer,
+		uint32_t, sequence,
+		uint64_t, timestamp,
+		int, status
+	),
+	TP_FIELDS(
+		ctf_integer(unsigned int, pipeline, pipeline)
+		ctf_integer(unsigned int, stream, stream)
+		ctf_integer(uint32_t, request, request)
+		ctf_integer_hex(uintptr_t, buffer, reinterpret_cast<uintptr_t>(buffer))
+		ctf_integer(uint32_t, sequence, sequence)
+		ctf_integer(uint64_t, timestamp, timestamp)
+		ctf_integer(int, status, status)
+	)
+)
+
+/* All buffers of a request have completed. */
+TRACEPOINT_EVENT(
+	libcamera_xisp,
+	complete_request,
+	TP_ARGS(
+		unsigned int, pipeline,
+		uint32_t, request,
+		uint64_t, timestamp
+	),
+	TP_FIELDS(
+		ctf_integer(unsigned int, pipeline, pipeline)
+		ctf_integer(uint32_t, request, request)
+		ctf_integer(uint64_t, timestamp, timestamp)
+	)
+)
+
+#endif /* XISP_TRACEPOINTS_H */
+
+#include <lttng/tracepoint-event.h>
+
+#define XISP_TRACEPOINT(...) tracepoint(libcamera_xisp, __VA_ARGS__)
+
+#else
+
+#define XISP_TRACEPOINT(...) do {} while (0)
+
+#endif /* HAVE_TRACING */
@@ -0,0 +1,1676 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025 - Mario Bergeron <Mario.Bergeron@avnet.com>
+ *
+ * Emulated xisp capture pipelines
+ *
+ * Register media graphs mimicking the xilinx-video capture pipelines of the
+ * xisp designs, with the same entity names, for the libcamera xisp pipeline
+ * handler to be run and profiled on machines without the hardware:
+ *
+ *   imx219 1-0010 -> 80050000.mipi_csi2_rx_subsystem -> a0010000.ISPPipeline_accel
+ *     -> a0040000.v_proc_ss -> vcap_mipi_0_v_proc output 0
+ *   80050000.mipi_csi2_rx_subsystem -> vcap_mipi_0_raw output 0
+ *   vcap_mipi_0_in input 0 -> a0010000.ISPPipeline_accel
+ *
+ * One media device is registered per capture pipeline, as done by the
+ * xilinx-video driver. Frames are produced by a thread per pipeline, at the
+ * frame rate set by the sensor blanking controls, and the csi2rx emits a
+ * V4L2_EVENT_FRAME_SYNC event at the start of each frame.
+ *
+ * The optional input video node reads Bayer frames from memory, in place of
+ * the csi2rx, when its link to the ISP is enabled. The sensor is then idle,
+ * and each input buffer is processed to the v_proc_ss outputs, one per frame
+ * period.
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+#include <media/media-device.h>
+#include <media/v4l2-ctrls.h>
+#include <media/v4l2-device.h>
+#include <media/v4l2-event.h>
+#include <media/v4l2-fh.h>
+#include <media/v4l2-ioctl.h>
+#include <media/v4l2-subdev.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-vmalloc.h>
+
+#define XEMU_DRIVER_NAME	"xisp-emu"
+
+#define XEMU_MAX_PIPELINES	4
+#define XEMU_MAX_OUTPUTS	4
+
+#define XEMU_MIN_WIDTH		64
+#define XEMU_MIN_HEIGHT		64
+#define XEMU_MAX_WIDTH		8192
+#define XEMU_MAX_HEIGHT		4320
+
+#define XEMU_EXPOSURE_MARGIN	4
+
+#define XEMU_CID_RED_GAIN	(V4L2_CID_USER_BASE | 0x1001)
+#define XEMU_CID_BLUE_GAIN	(V4L2_CID_USER_BASE | 0x1002)
+#define XEMU_CID_GAMMA		(V4L2_CID_USER_BASE | 0x1003)
+#define XEMU_CID_AWB_PERCENTILE	(V4L2_CID_USER_BASE | 0x1004)
+#define XEMU_CID_BAYER_PATTERN	(V4L2_CID_USER_BASE | 0x1005)
+
+static unsigned int pipelines = XEMU_MAX_PIPELINES;
+module_param(pipelines, uint, 0444);
+MODULE_PARM_DESC(pipelines, "Number of capture pipelines (1-4)");
+
+static unsigned int outputs = 1;
+module_param(outputs, uint, 0444);
+MODULE_PARM_DESC(outputs, "Number of v_proc_ss outputs per pipeline (1-4)");
+
+static bool raw_capture = true;
+module_param_named(raw, raw_capture, bool, 0444);
+MODULE_PARM_DESC(raw, "Expose a raw video node fed by the csi2rx");
+
+static bool input_node;
+module_param_named(input, input_node, bool, 0444);
+MODULE_PARM_DESC(input, "Expose an input video node feeding the ISP from memory");
+
+static bool aie;
+module_param(aie, bool, 0444);
+MODULE_PARM_DESC(aie, "Name the ISP entities after the AIE-ML ISP");
+
+static unsigned int fps = 30;
+module_param(fps, uint, 0444);
+MODULE_PARM_DESC(fps, "Default frame rate, within the limits of the sensor mode");
+
+static unsigned int stride_align = 1;
+module_param(stride_align, uint, 0444);
+MODULE_PARM_DESC(stride_align, "Alignment of the video node strides in bytes (power of 2)");
+
+static bool fill = true;
+module_param(fill, bool, 0444);
+MODULE_PARM_DESC(fill, "Fill the frames with a flat grey instead of leaving them untouched");
+
+static char *sensors[XEMU_MAX_PIPELINES];
+static int num_sensors;
+module_param_array(sensors, charp, &num_sensors, 0444);
+MODULE_PARM_DESC(sensors, "Sensor model of each pipeline (imx219, imx477, imx500, imx708)");
+
+/* -----------------------------------------------------------------------------
+ * Sensor models
+ */
+
+/*
+ * Mode timings as programmed by the sensor drivers: the line length, in pixel
+ * clock cycles, fixed per mode, and the minimum frame length in lines, which
+ * sets the vertical blanking limit and the maximum frame rate.
+ */
+struct xemu_sensor_mode {
+	unsigned int width;
+	unsigned int height;
+	unsigned int line_length;
+	unsigned int frame_length_min;
+};
+
+/* Frame length of a mode limited by a frame rate, as the drivers compute it. */
+#define XEMU_FRAME_LENGTH(pixel_rate, line_length, fps) \
+	((pixel_rate) / ((line_length) * (fps)))
+
+struct xemu_sensor_model {
+	const char *name;
+	unsigned short addr;
+	unsigned int width;
+	unsigned int height;
+	u64 pixel_rate;
+	unsigned int gain_max;
+	const struct xemu_sensor_mode *modes;
+	unsigned int num_modes;
+};
+
+/*
+ * The imx219 driver uses the same line length for all modes and a minimum
+ * vertical blanking of 32 lines. The 640x480 mode is analog binned, read at
+ * twice the pixel rate, which halves its line length here.
+ */
+static const struct xemu_sensor_mode imx219_modes[] = {
+	{ 3280, 2464, 3448, 2464 + 32 },
+	{ 1920, 1080, 3448, 1080 + 32 },
+	{ 1640, 1232, 3448, 1232 + 32 },
+	{ 640, 480, 3448 / 2, 480 + 32 },
+};
+
+/*
+ * The imx477 and imx500 drivers limit the frame length of each mode by its
+ * fastest frame interval.
+ */
+static const struct xemu_sensor_mode imx477_modes[] = {
+	{ 4056, 3040, 24000, XEMU_FRAME_LENGTH(840000000, 24000, 10) },
+	{ 2028, 1520, 12740, XEMU_FRAME_LENGTH(840000000, 12740, 40) },
+	{ 2028, 1080, 12740, XEMU_FRAME_LENGTH(840000000, 12740, 50) },
+	{ 1332, 990, 6664, XEMU_FRAME_LENGTH(840000000, 6664, 120) },
+};
+
+static const struct xemu_sensor_mode imx500_modes[] = {
+	{ 4056, 3040, 24000, XEMU_FRAME_LENGTH(744000000, 24000, 10) },
+	{ 2028, 1520, 12740, XEMU_FRAME_LENGTH(744000000, 12740, 30) },
+};
+
+/* The imx708 driver uses a minimum vertical blanking of 58 lines. */
+static const struct xemu_sensor_mode imx708_modes[] = {
+	{ 4608, 2592, 15648, 2592 + 58 },
+	{ 2304, 1296, 7824, 1296 + 58 },
+	{ 1536, 864, 5216, 864 + 58 },
+};
+
+static const struct xemu_sensor_model xemu_sensor_models[] = {
+	{ "imx219", 0x10, 3280, 2464, 182400000, 232,
+	  imx219_modes, ARRAY_SIZE(imx219_modes) },
+	{ "imx477", 0x1a, 4056, 3040, 840000000, 978,
+	  imx477_modes, ARRAY_SIZE(imx477_modes) },
+	{ "imx500", 0x1a, 4056, 3040, 744000000, 978,
+	  imx500_modes, ARRAY_SIZE(imx500_modes) },
+	{ "imx708", 0x1a, 4608, 2592, 595200000, 960,
+	  imx708_modes, ARRAY_SIZE(imx708_modes) },
+};
+
+/* Sensors of the reference design, in pipeline order. */
+static const char * const xemu_default_sensors[XEMU_MAX_PIPELINES] = {
+	"imx219", "imx708", "imx500", "imx477",
+};
+
+/* -----------------------------------------------------------------------------
+ * Video node formats
+ */
+
+struct xemu_format {
+	u32 fourcc;
+	/* Bytes per pixel, in 1/4 bytes, of the first plane. */
+	unsigned int bpp;
+	/* Size of the frame relative to the first plane, in 1/2. */
+	unsigned int size;
+	bool raw;
+};
+
+static const struct xemu_format xemu_formats[] = {
+	{ V4L2_PIX_FMT_BGR24, 12, 2, false },
+	{ V4L2_PIX_FMT_RGB24, 12, 2, false },
+	{ V4L2_PIX_FMT_YUYV, 8, 2, false },
+	{ V4L2_PIX_FMT_NV12, 4, 3, false },
+	{ V4L2_PIX_FMT_NV16, 4, 4, false },
+	{ V4L2_PIX_FMT_SRGGB10, 8, 2, true },
+	{ V4L2_PIX_FMT_SRGGB10P, 5, 2, true },
+};
+
+static const struct xemu_format *xemu_find_format(u32 fourcc, bool raw)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(xemu_formats); i++) {
+		if (xemu_formats[i].fourcc == fourcc && xemu_formats[i].raw == raw)
+			return &xemu_formats[i];
+	}
+
+	return NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * Device structures
+ */
+
+enum xemu_subdev_type {
+	XEMU_SENSOR,
+	XEMU_CSI2RX,
+	XEMU_ISP,
+	XEMU_VPSS,
+};
+
+struct xemu_subdev {
+	struct v4l2_subdev sd;
+	enum xemu_subdev_type type;
+	struct media_pad pads[2];
+	struct v4l2_mbus_framefmt formats[2];
+	struct v4l2_ctrl_handler ctrls;
+};
+
+struct xemu_sensor {
+	struct xemu_subdev sub;
+	const struct xemu_sensor_model *model;
+	const struct xemu_sensor_mode *mode;
+
+	struct v4l2_ctrl *hblank;
+	struct v4l2_ctrl *vblank;
+	struct v4l2_ctrl *exposure;
+
+	/* Protects the mode against concurrent set_fmt calls. */
+	struct mutex lock;
+	u64 frame_period;
+};
+
+struct xemu_buffer {
+	struct vb2_v4l2_buffer vb;
+	struct list_head list;
+};
+
+struct xemu_video {
+	struct video_device vdev;
+	struct media_pad pad;
+	struct vb2_queue queue;
+	/* Protects the video device and the queue. */
+	struct mutex lock;
+
+	bool raw;
+	const struct xemu_format *format;
+	struct v4l2_pix_format_mplane pix;
+
+	/* Protects the buffer list and the streaming flag. */
+	spinlock_t slock;
+	struct list_head buffers;
+	bool streaming;
+	/* Held by the frame thread while a buffer is being completed. */
+	struct mutex frame_lock;
+	/*
+	 * Sequence number of the next completed buffer. Like xilinx-dma, the
+	 * buffers are numbered and not the frames, a frame dropped for lack
+	 * of a buffer leaves no gap.
+	 */
+	u32 sequence;
+
+	struct xemu_pipeline *pipe;
+};
+
+struct xemu_pipeline {
+	struct device *dev;
+	unsigned int index;
+
+	struct media_device mdev;
+	struct v4l2_device v4l2_dev;
+
+	struct xemu_sensor sensor;
+	struct xemu_subdev csi2rx;
+	struct xemu_subdev isp;
+	struct xemu_subdev vpss[XEMU_MAX_OUTPUTS];
+	struct xemu_video vcap[XEMU_MAX_OUTPUTS];
+	struct xemu_video raw;
+	struct xemu_video input;
+	unsigned int num_outputs;
+	bool has_raw;
+	bool has_input;
+	/* Link from the input video node to the ISP, if any. */
+	struct media_link *input_link;
+
+	/* Protects the frame thread and the stream count. */
+	struct mutex lock;
+	struct task_struct *thread;
+	unsigned int streaming;
+	u32 sequence;
+};
+
+static inline struct xemu_subdev *to_xemu_subdev(struct v4l2_subdev *sd)
+{
+	return container_of(sd, struct xemu_subdev, sd);
+}
+
+static inline struct xemu_sensor *to_xemu_sensor(struct v4l2_subdev *sd)
+{
+	return container_of(to_xemu_subdev(sd), struct xemu_sensor, sub);
+}
+
+static struct xemu_video *xemu_video_list(struct xemu_pipeline *pipe,
+					  unsigned int index)
+{
+	if (index < pipe->num_outputs)
+		return &pipe->vcap[index];
+	index -= pipe->num_outputs;
+
+	if (pipe->has_raw && !index--)
+		return &pipe->raw;
+	if (pipe->has_input && !index--)
+		return &pipe->input;
+
+	return NULL;
+}
+
+/* Tell if the ISP reads its frames from the input video node. */
+static bool xemu_pipeline_reprocessing(struct xemu_pipeline *pipe)
+{
+	return pipe->input_link &&
+	       (READ_ONCE(pipe->input_link->flags) & MEDIA_LNK_FL_ENABLED);
+}
+
+/* -----------------------------------------------------------------------------
+ * Sensor
+ */
+
+static void xemu_sensor_update_period(struct xemu_sensor *sensor)
+{
+	unsigned int line = sensor->mode->width + sensor->hblank->val;
+	unsigned int frame = sensor->mode->height + sensor->vblank->val;
+
+	WRITE_ONCE(sensor->frame_period,
+		   div64_u64((u64)line * frame * NSEC_PER_SEC,
+			     sensor->model->pixel_rate));
+}
+
+static int xemu_sensor_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct xemu_sensor *sensor =
+		container_of(ctrl->handler, struct xemu_sensor, sub.ctrls);
+	unsigned int frame;
+
+	switch (ctrl->id) {
+	case V4L2_CID_VBLANK:
+		frame = sensor->mode->height + ctrl->val;
+		__v4l2_ctrl_modify_range(sensor->exposure, 1,
+					 frame - XEMU_EXPOSURE_MARGIN, 1,
+					 min_t(s64, sensor->exposure->default_value,
+					       frame - XEMU_EXPOSURE_MARGIN));
+		xemu_sensor_update_period(sensor);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops xemu_sensor_ctrl_ops = {
+	.s_ctrl = xemu_sensor_s_ctrl,
+};
+
+/*
+ * Apply the blanking limits of the current mode, with a default frame rate
+ * set by the fps module parameter.
+ */
+static void xemu_sensor_update_blanking(struct xemu_sensor *sensor)
+{
+	const struct xemu_sensor_mode *mode = sensor->mode;
+	unsigned int line = mode->line_length;
+	unsigned int hblank = line - mode->width;
+	unsigned int vblank_min = mode->frame_length_min - mode->height;
+	unsigned int vblank_max = 0xffff - mode->height;
+	unsigned int vblank;
+
+	vblank = div64_u64(sensor->model->pixel_rate, (u64)line * max(fps, 1U));
+	vblank = clamp_t(int, (int)vblank - (int)mode->height,
+			 vblank_min, vblank_max);
+
+	v4l2_ctrl_modify_range(sensor->hblank, hblank, hblank, 1, hblank);
+	v4l2_ctrl_modify_range(sensor->vblank, vblank_min, vblank_max, 1,
+			       vblank);
+	v4l2_ctrl_s_ctrl(sensor->vblank, vblank);
+
+	/* s_ctrl isn't called when the vblank value is unchanged. */
+	v4l2_ctrl_modify_range(sensor->exposure, 1,
+			       mode->height + vblank - XEMU_EXPOSURE_MARGIN, 1,
+			       min_t(s64, sensor->exposure->default_value,
+				     mode->height + vblank - XEMU_EXPOSURE_MARGIN));
+	xemu_sensor_update_period(sensor);
+}
+
+static void xemu_sensor_fill_format(const struct xemu_sensor_mode *mode,
+				    struct v4l2_mbus_framefmt *format)
+{
+	format->width = mode->width;
+	format->height = mode->height;
+	format->code = MEDIA_BUS_FMT_SRGGB10_1X10;
+	format->field = V4L2_FIELD_NONE;
+	format->colorspace = V4L2_COLORSPACE_RAW;
+	format->ycbcr_enc = V4L2_YCBCR_ENC_601;
+	format->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+	format->xfer_func = V4L2_XFER_FUNC_NONE;
+}
+
+static int xemu_sensor_enum_mbus_code(struct v4l2_subdev *sd,
+				      struct v4l2_subdev_state *state,
+				      struct v4l2_subdev_mbus_code_enum *code)
+{
+	if (code->index > 0)
+		return -EINVAL;
+
+	code->code = MEDIA_BUS_FMT_SRGGB10_1X10;
+	return 0;
+}
+
+static int xemu_sensor_enum_frame_size(struct v4l2_subdev *sd,
+				       struct v4l2_subdev_state *state,
+				       struct v4l2_subdev_frame_size_enum *fse)
+{
+	struct xemu_sensor *sensor = to_xemu_sensor(sd);
+	const struct xemu_sensor_mode *mode;
+
+	if (fse->code != MEDIA_BUS_FMT_SRGGB10_1X10 ||
+	    fse->index >= sensor->model->num_modes)
+		return -EINVAL;
+
+	mode = &sensor->model->modes[fse->index];
+	fse->min_width = mode->width;
+	fse->max_width = mode->width;
+	fse->min_height = mode->height;
+	fse->max_height = mode->height;
+
+	return 0;
+}
+
+static int xemu_sensor_get_fmt(struct v4l2_subdev *sd,
+			       struct v4l2_subdev_state *state,
+			       struct v4l2_subdev_format *fmt)
+{
+	struct xemu_sensor *sensor = to_xemu_sensor(sd);
+
+	mutex_lock(&sensor->lock);
+	xemu_sensor_fill_format(sensor->mode, &fmt->format);
+	mutex_unlock(&sensor->lock);
+
+	return 0;
+}
+
+static int xemu_sensor_set_fmt(struct v4l2_subdev *sd,
+			       struct v4l2_subdev_state *state,
+			       struct v4l2_subdev_format *fmt)
+{
+	struct xemu_sensor *sensor = to_xemu_sensor(sd);
+	const struct xemu_sensor_mode *mode;
+
+	mode = v4l2_find_nearest_size(sensor->model->modes,
+				      sensor->model->num_modes, width, height,
+				      fmt->format.width, fmt->format.height);
+	xemu_sensor_fill_format(mode, &fmt->format);
+
+	if (fmt->which == V4L2_SUBDEV_FORMAT_TRY)
+		return 0;
+
+	mutex_lock(&sensor->lock);
+	if (sensor->mode != mode) {
+		sensor->mode = mode;
+		xemu_sensor_update_blanking(sensor);
+	}
+	mutex_unlock(&sensor->lock);
+
+	return 0;
+}
+
+static int xemu_sensor_get_selection(struct v4l2_subdev *sd,
+				     struct v4l2_subdev_state *state,
+				     struct v4l2_subdev_selection *sel)
+{
+	struct xemu_sensor *sensor = to_xemu_sensor(sd);
+	const struct xemu_sensor_model *model = sensor->model;
+	unsigned int width, height;
+
+	switch (sel->target) {
+	case V4L2_SEL_TGT_NATIVE_SIZE:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+		sel->r.left = 0;
+		sel->r.top = 0;
+		sel->r.width = model->width;
+		sel->r.height = model->height;
+		return 0;
+
+	case V4L2_SEL_TGT_CROP:
+		/* Modes up to half the pixel array are binned 2x2. */
+		mutex_lock(&sensor->lock);
+		width = sensor->mode->width;
+		height = sensor->mode->height;
+		mutex_unlock(&sensor->lock);
+
+		if (width * 2 <= model->width && height * 2 <= model->height) {
+			width *= 2;
+			height *= 2;
+		}
+
+		sel->r.left = (model->width - width) / 2;
+		sel->r.top = (model->height - height) / 2;
+		sel->r.width = width;
+		sel->r.height = height;
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct v4l2_subdev_pad_ops xemu_sensor_pad_ops = {
+	.enum_mbus_code = xemu_sensor_enum_mbus_code,
+	.enum_frame_size = xemu_sensor_enum_frame_size,
+	.get_fmt = xemu_sensor_get_fmt,
+	.set_fmt = xemu_sensor_set_fmt,
+	.get_selection = xemu_sensor_get_selection,
+};
+
+static const struct v4l2_subdev_ops xemu_sensor_ops = {
+	.pad = &xemu_sensor_pad_ops,
+};
+
+static int xemu_sensor_init_controls(struct xemu_sensor *sensor)
+{
+	const struct xemu_sensor_model *model = sensor->model;
+	struct v4l2_ctrl_handler *hdl = &sensor->sub.ctrls;
+	struct v4l2_ctrl *ctrl;
+
+	v4l2_ctrl_handler_init(hdl, 9);
+
+	ctrl = v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops, V4L2_CID_PIXEL_RATE,
+				 model->pixel_rate, model->pixel_rate, 1,
+				 model->pixel_rate);
+	if (ctrl)
+		ctrl->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+
+	sensor->hblank = v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops,
+					   V4L2_CID_HBLANK, 0, 0xffff, 1, 0);
+	if (sensor->hblank)
+		sensor->hblank->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+
+	/* The limits are set by the mode, see xemu_sensor_update_blanking(). */
+	sensor->vblank = v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops,
+					   V4L2_CID_VBLANK, 0, 0xffff, 1, 0);
+	sensor->exposure = v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops,
+					     V4L2_CID_EXPOSURE, 1, 0xffff, 1,
+					     1000);
+	v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops, V4L2_CID_ANALOGUE_GAIN,
+			  0, model->gain_max, 1, 0);
+	v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops, V4L2_CID_HFLIP, 0, 1, 1, 0);
+	v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops, V4L2_CID_VFLIP, 0, 1, 1, 0);
+	v4l2_ctrl_new_std_menu(hdl, &xemu_sensor_ctrl_ops,
+			       V4L2_CID_CAMERA_ORIENTATION,
+			       V4L2_CAMERA_ORIENTATION_EXTERNAL, 0,
+			       V4L2_CAMERA_ORIENTATION_EXTERNAL);
+	v4l2_ctrl_new_std(hdl, &xemu_sensor_ctrl_ops,
+			  V4L2_CID_CAMERA_SENSOR_ROTATION, 0, 0, 1, 0);
+
+	if (hdl->error)
+		return hdl->error;
+
+	sensor->sub.sd.ctrl_handler = hdl;
+	return 0;
+}
+
+static int xemu_sensor_init(struct xemu_pipeline *pipe, const char *name)
+{
+	struct xemu_sensor *sensor = &pipe->sensor;
+	const struct xemu_sensor_model *model = NULL;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(xemu_sensor_models); i++) {
+		if (!strcmp(xemu_sensor_models[i].name, name))
+			model = &xemu_sensor_models[i];
+	}
+
+	if (!model) {
+		dev_err(pipe->dev, "unknown sensor model %s\n", name);
+		return -EINVAL;
+	}
+
+	sensor->model = model;
+	sensor->mode = &model->modes[0];
+	mutex_init(&sensor->lock);
+
+	ret = xemu_sensor_init_controls(sensor);
+	if (ret)
+		return ret;
+
+	xemu_sensor_update_blanking(sensor);
+
+	/* The bus number follows the reference design, one I2C bus per pipeline. */
+	v4l2_subdev_init(&sensor->sub.sd, &xemu_sensor_ops);
+	sensor->sub.sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
+	snprintf(sensor->sub.sd.name, sizeof(sensor->sub.sd.name), "%s %u-%04x",
+		 model->name, pipe->index + 1, model->addr);
+	sensor->sub.sd.entity.function = MEDIA_ENT_F_CAM_SENSOR;
+	sensor->sub.type = XEMU_SENSOR;
+
+	sensor->sub.pads[0].flags = MEDIA_PAD_FL_SOURCE;
+	return media_entity_pads_init(&sensor->sub.sd.entity, 1, sensor->sub.pads);
+}
+
+/* -----------------------------------------------------------------------------
+ * csi2rx, ISP and v_proc_ss
+ *
+ * The formats are only stored. The csi2rx source pad mirrors the sink pad,
+ * and the ISP outputs the AXI4-Stream RBG format at the input size.
+ */
+
+static void xemu_subdev_adjust(struct xemu_subdev *sub, unsigned int pad,
+			       struct v4l2_mbus_framefmt *format)
+{
+	format->width = clamp_t(u32, ALIGN(format->width, 2), XEMU_MIN_WIDTH,
+				XEMU_MAX_WIDTH);
+	format->height = clamp_t(u32, format->height, XEMU_MIN_HEIGHT,
+				 XEMU_MAX_HEIGHT);
+	format->field = V4L2_FIELD_NONE;
+
+	if (pad == 0)
+		return;
+
+	switch (sub->type) {
+	case XEMU_CSI2RX:
+		*format = sub->formats[0];
+		break;
+	case XEMU_ISP:
+		format->code = MEDIA_BUS_FMT_RBG888_1X24;
+		format->width = sub->formats[0].width;
+		format->height = sub->formats[0].height;
+		format->colorspace = V4L2_COLORSPACE_SRGB;
+		break;
+	case XEMU_VPSS:
+		if (format->code != MEDIA_BUS_FMT_UYVY8_1X16 &&
+		    format->code != MEDIA_BUS_FMT_VYYUYY8_1X24)
+			format->code = MEDIA_BUS_FMT_RBG888_1X24;
+		break;
+	default:
+		break;
+	}
+}
+
+static int xemu_subdev_enum_mbus_code(struct v4l2_subdev *sd,
+				      struct v4l2_subdev_state *state,
+				      struct v4l2_subdev_mbus_code_enum *code)
+{
+	struct xemu_subdev *sub = to_xemu_subdev(sd);
+
+	if (code->pad >= sub->sd.entity.num_pads || code->index > 0)
+		return -EINVAL;
+
+	code->code = sub->formats[code->pad].code;
+	return 0;
+}
+
+static int xemu_subdev_get_fmt(struct v4l2_subdev *sd,
+			       struct v4l2_subdev_state *state,
+			       struct v4l2_subdev_format *fmt)
+{
+	struct xemu_subdev *sub = to_xemu_subdev(sd);
+
+	if (fmt->pad >= sub->sd.entity.num_pads)
+		return -EINVAL;
+
+	fmt->format = sub->formats[fmt->pad];
+	return 0;
+}
+
+static int xemu_subdev_set_fmt(struct v4l2_subdev *sd,
+			       struct v4l2_subdev_state *state,
+			       struct v4l2_subdev_format *fmt)
+{
+	struct xemu_subdev *sub = to_xemu_subdev(sd);
+
+	if (fmt->pad >= sub->sd.entity.num_pads)
+		return -EINVAL;
+
+	xemu_subdev_adjust(sub, fmt->pad, &fmt->format);
+
+	if (fmt->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
+		sub->formats[fmt->pad] = fmt->format;
+		if (fmt->pad == 0 && sub->type != XEMU_VPSS) {
+			sub->formats[1] = fmt->format;
+			xemu_subdev_adjust(sub, 1, &sub->formats[1]);
+		}
+	}
+
+	return 0;
+}
+
+static int xemu_csi2rx_subscribe_event(struct v4l2_subdev *sd,
+				       struct v4l2_fh *fh,
+				       struct v4l2_event_subscription *sub)
+{
+	if (sub->type != V4L2_EVENT_FRAME_SYNC)
+		return -EINVAL;
+
+	return v4l2_event_subscribe(fh, sub, 2, NULL);
+}
+
+static int xemu_isp_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	/* The frames are not processed, the ISP controls are only stored. */
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops xemu_isp_ctrl_ops = {
+	.s_ctrl = xemu_isp_s_ctrl,
+};
+
+/* Bayer phases of the ISPPipeline_accel mode register, in register order. */
+static const char * const xemu_isp_bayer_patterns[] = {
+	"BGGR",
+	"GBRG",
+	"GRBG",
+	"RGGB",
+};
+
+/*
+ * Controls of the ISPPipeline_accel kernel arguments: the white balance
+ * gains, the gamma, the percentile of the AWB histogram and the Bayer phase
+ * of the demosaicing.
+ */
+static const struct v4l2_ctrl_config xemu_isp_ctrls[] = {
+	{
+		.ops = &xemu_isp_ctrl_ops,
+		.id = XEMU_CID_RED_GAIN,
+		.name = "Red Gain",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 0,
+		.max = 8191,
+		.step = 1,
+		.def = 1024,
+	}, {
+		.ops = &xemu_isp_ctrl_ops,
+		.id = XEMU_CID_BLUE_GAIN,
+		.name = "Blue Gain",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 0,
+		.max = 8191,
+		.step = 1,
+		.def = 1024,
+	}, {
+		.ops = &xemu_isp_ctrl_ops,
+		.id = XEMU_CID_GAMMA,
+		.name = "Gamma",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 1,
+		.max = 40,
+		.step = 1,
+		.def = 22,
+	}, {
+		.ops = &xemu_isp_ctrl_ops,
+		.id = XEMU_CID_AWB_PERCENTILE,
+		.name = "AWB Percentile",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 0,
+		.max = 256,
+		.step = 1,
+		.def = 128,
+	}, {
+		.ops = &xemu_isp_ctrl_ops,
+		.id = XEMU_CID_BAYER_PATTERN,
+		.name = "Bayer Pattern",
+		.type = V4L2_CTRL_TYPE_MENU,
+		.max = ARRAY_SIZE(xemu_isp_bayer_patterns) - 1,
+		/* The sensors output RGGB. */
+		.def = 3,
+		.qmenu = xemu_isp_bayer_patterns,
+	},
+};
+
+/*
+ * The ISP sink is fed by either the csi2rx or the input video node, the link
+ * of one has to be disabled before enabling the other. The source can't be
+ * changed while streaming.
+ */
+static int xemu_isp_link_setup(struct media_entity *entity,
+			       const struct media_pad *local,
+			       const struct media_pad *remote, u32 flags)
+{
+	struct xemu_subdev *sub = to_xemu_subdev(media_entity_to_v4l2_subdev(entity));
+	struct xemu_pipeline *pipe = container_of(sub, struct xemu_pipeline, isp);
+	struct media_link *link;
+	int ret = 0;
+
+	if (!(local->flags & MEDIA_PAD_FL_SINK))
+		return 0;
+
+	mutex_lock(&pipe->lock);
+
+	if (pipe->streaming) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (!(flags & MEDIA_LNK_FL_ENABLED))
+		goto out;
+
+	list_for_each_entry(link, &entity->links, list) {
+		if (link->sink == local && link->source != remote &&
+		    (link->flags & MEDIA_LNK_FL_ENABLED)) {
+			ret = -EBUSY;
+			break;
+		}
+	}
+
+out:
+	mutex_unlock(&pipe->lock);
+	return ret;
+}
+
+static const struct media_entity_operations xemu_isp_entity_ops = {
+	.link_setup = xemu_isp_link_setup,
+};
+
+static const struct v4l2_subdev_core_ops xemu_csi2rx_core_ops = {
+	.subscribe_event = xemu_csi2rx_subscribe_event,
+	.unsubscribe_event = v4l2_event_subdev_unsubscribe,
+};
+
+static const struct v4l2_subdev_pad_ops xemu_subdev_pad_ops = {
+	.enum_mbus_code = xemu_subdev_enum_mbus_code,
+	.get_fmt = xemu_subdev_get_fmt,
+	.set_fmt = xemu_subdev_set_fmt,
+};
+
+static const struct v4l2_subdev_ops xemu_csi2rx_ops = {
+	.core = &xemu_csi2rx_core_ops,
+	.pad = &xemu_subdev_pad_ops,
+};
+
+static const struct v4l2_subdev_ops xemu_subdev_ops = {
+	.pad = &xemu_subdev_pad_ops,
+};
+
+static int xemu_subdev_init(struct xemu_subdev *sub, enum xemu_subdev_type type,
+			    const char *name)
+{
+	const struct v4l2_mbus_framefmt format = {
+		.width = 1920,
+		.height = 1080,
+		.code = type == XEMU_CSI2RX ? MEDIA_BUS_FMT_SRGGB10_1X10
+					    : MEDIA_BUS_FMT_RBG888_1X24,
+		.field = V4L2_FIELD_NONE,
+		.colorspace = V4L2_COLORSPACE_SRGB,
+	};
+	unsigned int i;
+
+	sub->type = type;
+	sub->formats[0] = format;
+	sub->formats[1] = format;
+	if (type == XEMU_ISP)
+		sub->formats[0].code = MEDIA_BUS_FMT_SRGGB10_1X10;
+
+	switch (type) {
+	case XEMU_CSI2RX:
+		v4l2_subdev_init(&sub->sd, &xemu_csi2rx_ops);
+		sub->sd.flags |= V4L2_SUBDEV_FL_HAS_EVENTS;
+		sub->sd.entity.function = MEDIA_ENT_F_VID_IF_BRIDGE;
+		break;
+
+	case XEMU_ISP:
+		v4l2_subdev_init(&sub->sd, &xemu_subdev_ops);
+		sub->sd.entity.function = MEDIA_ENT_F_PROC_VIDEO_ISP;
+		sub->sd.entity.ops = &xemu_isp_entity_ops;
+
+		v4l2_ctrl_handler_init(&sub->ctrls, ARRAY_SIZE(xemu_isp_ctrls));
+		for (i = 0; i < ARRAY_SIZE(xemu_isp_ctrls); i++)
+			v4l2_ctrl_new_custom(&sub->ctrls, &xemu_isp_ctrls[i], NULL);
+		if (sub->ctrls.error)
+			return sub->ctrls.error;
+		sub->sd.ctrl_handler = &sub->ctrls;
+		break;
+
+	default:
+		v4l2_subdev_init(&sub->sd, &xemu_subdev_ops);
+		sub->sd.entity.function = MEDIA_ENT_F_PROC_VIDEO_SCALER;
+		break;
+	}
+
+	strscpy(sub->sd.name, name, sizeof(sub->sd.name));
+	sub->sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
+
+	sub->pads[0].flags = MEDIA_PAD_FL_SINK;
+	sub->pads[1].flags = MEDIA_PAD_FL_SOURCE;
+	return media_entity_pads_init(&sub->sd.entity, 2, sub->pads);
+}
+
+/* -----------------------------------------------------------------------------
+ * Video nodes
+ */
+
+static void xemu_video_adjust(struct xemu_video *video,
+			      struct v4l2_pix_format_mplane *pix)
+{
+	const struct xemu_format *format;
+	unsigned int bpl;
+
+	format = xemu_find_format(pix->pixelformat, video->raw);
+	if (!format)
+		format = xemu_find_format(video->raw ? V4L2_PIX_FMT_SRGGB10
+						     : V4L2_PIX_FMT_BGR24,
+					  video->raw);
+
+	pix->pixelformat = format->fourcc;
+	pix->width = clamp_t(u32, ALIGN(pix->width, 2), XEMU_MIN_WIDTH,
+			     XEMU_MAX_WIDTH);
+	pix->height = clamp_t(u32, ALIGN(pix->height, 2), XEMU_MIN_HEIGHT,
+			      XEMU_MAX_HEIGHT);
+	pix->field = V4L2_FIELD_NONE;
+	pix->colorspace = format->raw ? V4L2_COLORSPACE_RAW : V4L2_COLORSPACE_SRGB;
+	pix->num_planes = 1;
+
+	/* Keep the stride requested by the application if large enough. */
+	bpl = DIV_ROUND_UP(pix->width * format->bpp, 4);
+	bpl = max(bpl, min_t(u32, pix->plane_fmt[0].bytesperline, bpl * 2));
+	if (stride_align > 1)
+		bpl = ALIGN(bpl, roundup_pow_of_two(stride_align));
+
+	pix->plane_fmt[0].bytesperline = bpl;
+	pix->plane_fmt[0].sizeimage = bpl * pix->height * format->size / 2;
+	memset(pix->plane_fmt[0].reserved, 0, sizeof(pix->plane_fmt[0].reserved));
+	memset(pix->reserved, 0, sizeof(pix->reserved));
+}
+
+static int xemu_querycap(struct file *file, void *priv,
+			 struct v4l2_capability *cap)
+{
+	struct xemu_video *video = video_drvdata(file);
+
+	strscpy(cap->driver, XEMU_DRIVER_NAME, sizeof(cap->driver));
+	strscpy(cap->card, video->vdev.name, sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform:%s",
+		 dev_name(video->pipe->dev));
+
+	return 0;
+}
+
+static int xemu_enum_fmt(struct file *file, void *priv, struct v4l2_fmtdesc *f)
+{
+	struct xemu_video *video = video_drvdata(file);
+	unsigned int index = f->index;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(xemu_formats); i++) {
+		if (xemu_formats[i].raw != video->raw)
+			continue;
+
+		if (!index--) {
+			f->pixelformat = xemu_formats[i].fourcc;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int xemu_enum_framesizes(struct file *file, void *priv,
+				struct v4l2_frmsizeenum *fsize)
+{
+	struct xemu_video *video = video_drvdata(file);
+
+	if (fsize->index > 0 ||
+	    !xemu_find_format(fsize->pixel_format, video->raw))
+		return -EINVAL;
+
+	fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+	fsize->stepwise.min_width = XEMU_MIN_WIDTH;
+	fsize->stepwise.max_width = XEMU_MAX_WIDTH;
+	fsize->stepwise.step_width = 2;
+	fsize->stepwise.min_height = XEMU_MIN_HEIGHT;
+	fsize->stepwise.max_height = XEMU_MAX_HEIGHT;
+	fsize->stepwise.step_height = 2;
+
+	return 0;
+}
+
+static int xemu_g_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+	struct xemu_video *video = video_drvdata(file);
+
+	f->fmt.pix_mp = video->pix;
+	return 0;
+}
+
+static int xemu_try_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+	struct xemu_video *video = video_drvdata(file);
+
+	xemu_video_adjust(video, &f->fmt.pix_mp);
+	return 0;
+}
+
+static int xemu_s_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+	struct xemu_video *video = video_drvdata(file);
+
+	if (vb2_is_busy(&video->queue))
+		return -EBUSY;
+
+	xemu_video_adjust(video, &f->fmt.pix_mp);
+	video->pix = f->fmt.pix_mp;
+	video->format = xemu_find_format(video->pix.pixelformat, video->raw);
+
+	return 0;
+}
+
+static const struct v4l2_ioctl_ops xemu_ioctl_ops = {
+	.vidioc_querycap = xemu_querycap,
+	.vidioc_enum_fmt_vid_cap = xemu_enum_fmt,
+	.vidioc_enum_framesizes = xemu_enum_framesizes,
+	.vidioc_g_fmt_vid_cap_mplane = xemu_g_fmt,
+	.vidioc_s_fmt_vid_cap_mplane = xemu_s_fmt,
+	.vidioc_try_fmt_vid_cap_mplane = xemu_try_fmt,
+
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
+};
+
+static const struct v4l2_ioctl_ops xemu_output_ioctl_ops = {
+	.vidioc_querycap = xemu_querycap,
+	.vidioc_enum_fmt_vid_out = xemu_enum_fmt,
+	.vidioc_enum_framesizes = xemu_enum_framesizes,
+	.vidioc_g_fmt_vid_out_mplane = xemu_g_fmt,
+	.vidioc_s_fmt_vid_out_mplane = xemu_s_fmt,
+	.vidioc_try_fmt_vid_out_mplane = xemu_try_fmt,
+
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
+};
+
+static const struct v4l2_file_operations xemu_fops = {
+	.owner = THIS_MODULE,
+	.open = v4l2_fh_open,
+	.release = vb2_fop_release,
+	.unlocked_ioctl = video_ioctl2,
+	.poll = vb2_fop_poll,
+	.mmap = vb2_fop_mmap,
+};
+
+static int xemu_frame_thread(void *data);
+
+static int xemu_queue_setup(struct vb2_queue *vq, unsigned int *nbuffers,
+			    unsigned int *nplanes, unsigned int sizes[],
+			    struct device *alloc_devs[])
+{
+	struct xemu_video *video = vb2_get_drv_priv(vq);
+	unsigned int size = video->pix.plane_fmt[0].sizeimage;
+
+	if (*nplanes)
+		return *nplanes != 1 || sizes[0] < size ? -EINVAL : 0;
+
+	*nplanes = 1;
+	sizes[0] = size;
+
+	return 0;
+}
+
+static int xemu_buffer_prepare(struct vb2_buffer *vb)
+{
+	struct xemu_video *video = vb2_get_drv_priv(vb->vb2_queue);
+	unsigned long size = video->pix.plane_fmt[0].sizeimage;
+
+	if (vb2_plane_size(vb, 0) < size)
+		return -EINVAL;
+
+	/* Input frames are read from memory, their payload set by userspace. */
+	if (V4L2_TYPE_IS_OUTPUT(vb->type))
+		return vb2_get_plane_payload(vb, 0) < size ? -EINVAL : 0;
+
+	vb2_set_plane_payload(vb, 0, size);
+	return 0;
+}
+
+static void xemu_buffer_queue(struct vb2_buffer *vb)
+{
+	struct xemu_video *video = vb2_get_drv_priv(vb->vb2_queue);
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct xemu_buffer *buf = container_of(vbuf, struct xemu_buffer, vb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&video->slock, flags);
+	list_add_tail(&buf->list, &video->buffers);
+	spin_unlock_irqrestore(&video->slock, flags);
+}
+
+static void xemu_return_buffers(struct xemu_video *video,
+				enum vb2_buffer_state state)
+{
+	struct xemu_buffer *buf, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&video->slock, flags);
+	list_for_each_entry_safe(buf, tmp, &video->buffers, list) {
+		list_del(&buf->list);
+		vb2_buffer_done(&buf->vb.vb2_buf, state);
+	}
+	spin_unlock_irqrestore(&video->slock, flags);
+}
+
+static int xemu_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct xemu_video *video = vb2_get_drv_priv(vq);
+	struct xemu_pipeline *pipe = video->pipe;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&video->slock, flags);
+	video->streaming = true;
+	video->sequence = 0;
+	spin_unlock_irqrestore(&video->slock, flags);
+
+	mutex_lock(&pipe->lock);
+	if (!pipe->streaming++) {
+		pipe->sequence = 0;
+		pipe->thread = kthread_run(xemu_frame_thread, pipe, "%s",
+					   dev_name(pipe->dev));
+		if (IS_ERR(pipe->thread)) {
+			ret = PTR_ERR(pipe->thread);
+			pipe->thread = NULL;
+			pipe->streaming--;
+		}
+	}
+	mutex_unlock(&pipe->lock);
+
+	if (ret) {
+		spin_lock_irqsave(&video->slock, flags);
+		video->streaming = false;
+		spin_unlock_irqrestore(&video->slock, flags);
+		xemu_return_buffers(video, VB2_BUF_STATE_QUEUED);
+	}
+
+	return ret;
+}
+
+static void xemu_stop_streaming(struct vb2_queue *vq)
+{
+	struct xemu_video *video = vb2_get_drv_priv(vq);
+	struct xemu_pipeline *pipe = video->pipe;
+	unsigned long flags;
+
+	spin_lock_irqsave(&video->slock, flags);
+	video->streaming = false;
+	spin_unlock_irqrestore(&video->slock, flags);
+
+	/* Wait for the buffer being completed, if any. */
+	mutex_lock(&video->frame_lock);
+	mutex_unlock(&video->frame_lock);
+
+	mutex_lock(&pipe->lock);
+	if (!--pipe->streaming) {
+		kthread_stop(pipe->thread);
+		pipe->thread = NULL;
+	}
+	mutex_unlock(&pipe->lock);
+
+	xemu_return_buffers(video, VB2_BUF_STATE_ERROR);
+}
+
+static const struct vb2_ops xemu_vb2_ops = {
+	.queue_setup = xemu_queue_setup,
+	.buf_prepare = xemu_buffer_prepare,
+	.buf_queue = xemu_buffer_queue,
+	.start_streaming = xemu_start_streaming,
+	.stop_streaming = xemu_stop_streaming,
+};
+
+static int xemu_video_init(struct xemu_pipeline *pipe, struct xemu_video *video,
+			   const char *name, bool raw, bool output)
+{
+	struct video_device *vdev = &video->vdev;
+	struct vb2_queue *queue = &video->queue;
+	int ret;
+
+	video->pipe = pipe;
+	video->raw = raw;
+	mutex_init(&video->lock);
+	mutex_init(&video->frame_lock);
+	spin_lock_init(&video->slock);
+	INIT_LIST_HEAD(&video->buffers);
+
+	video->pix.pixelformat = raw ? V4L2_PIX_FMT_SRGGB10 : V4L2_PIX_FMT_BGR24;
+	video->pix.width = 1920;
+	video->pix.height = 1080;
+	xemu_video_adjust(video, &video->pix);
+	video->format = xemu_find_format(video->pix.pixelformat, raw);
+
+	queue->type = output ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE
+			     : V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	queue->io_modes = VB2_MMAP | VB2_DMABUF;
+	queue->drv_priv = video;
+	queue->buf_struct_size = sizeof(struct xemu_buffer);
+	queue->ops = &xemu_vb2_ops;
+	queue->mem_ops = &vb2_vmalloc_memops;
+	queue->timestamp_flags = output ? V4L2_BUF_FLAG_TIMESTAMP_COPY
+				       : V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	queue->lock = &video->lock;
+	queue->dev = pipe->dev;
+
+	ret = vb2_queue_init(queue);
+	if (ret)
+		return ret;
+
+	strscpy(vdev->name, name, sizeof(vdev->name));
+	vdev->fops = &xemu_fops;
+	vdev->ioctl_ops = output ? &xemu_output_ioctl_ops : &xemu_ioctl_ops;
+	vdev->release = video_device_release_empty;
+	vdev->v4l2_dev = &pipe->v4l2_dev;
+	vdev->queue = queue;
+	vdev->lock = &video->lock;
+	vdev->vfl_dir = output ? VFL_DIR_TX : VFL_DIR_RX;
+	vdev->device_caps = (output ? V4L2_CAP_VIDEO_OUTPUT_MPLANE
+				    : V4L2_CAP_VIDEO_CAPTURE_MPLANE) |
+			    V4L2_CAP_STREAMING;
+	vdev->entity.function = MEDIA_ENT_F_IO_V4L;
+	video_set_drvdata(vdev, video);
+
+	video->pad.flags = output ? MEDIA_PAD_FL_SOURCE : MEDIA_PAD_FL_SINK;
+	return media_entity_pads_init(&vdev->entity, 1, &video->pad);
+}
+
+/* -----------------------------------------------------------------------------
+ * Frame generation
+ */
+
+static void xemu_fill_buffer(struct xemu_video *video, struct vb2_buffer *vb)
+{
+	void *mem = vb2_plane_vaddr(vb, 0);
+	size_t size = vb2_get_plane_payload(vb, 0);
+
+	if (!mem)
+		return;
+
+	/* Mid-grey, 0x200 in 10-bit Bayer. */
+	if (video->format->fourcc == V4L2_PIX_FMT_SRGGB10)
+		memset16(mem, 0x0200, size / 2);
+	else
+		memset(mem, 0x80, size);
+}
+
+/*
+ * Complete a buffer of a capture video node, with the frame read from the
+ * input buffer src if any, or else from the sensor.
+ */
+static void xemu_complete_frame(struct xemu_video *video,
+				const struct vb2_v4l2_buffer *src)
+{
+	struct xemu_buffer *buf;
+	unsigned long flags;
+
+	mutex_lock(&video->frame_lock);
+
+	spin_lock_irqsave(&video->slock, flags);
+	if (!video->streaming || list_empty(&video->buffers)) {
+		/* No buffer available, the frame is dropped. */
+		spin_unlock_irqrestore(&video->slock, flags);
+		mutex_unlock(&video->frame_lock);
+		return;
+	}
+
+	buf = list_first_entry(&video->buffers, struct xemu_buffer, list);
+	list_del(&buf->list);
+	spin_unlock_irqrestore(&video->slock, flags);
+
+	if (fill)
+		xemu_fill_buffer(video, &buf->vb.vb2_buf);
+
+	buf->vb.vb2_buf.timestamp = src ? src->vb2_buf.timestamp : ktime_get_ns();
+	buf->vb.sequence = video->sequence++;
+	buf->vb.field = V4L2_FIELD_NONE;
+	vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+
+	mutex_unlock(&video->frame_lock);
+}
+
+/* Process the next queued input buffer, if any, to the v_proc_ss outputs. */
+static void xemu_process_input(struct xemu_pipeline *pipe)
+{
+	struct xemu_video *input = &pipe->input;
+	struct xemu_buffer *buf;
+	unsigned long flags;
+	unsigned int i;
+
+	mutex_lock(&input->frame_lock);
+
+	spin_lock_irqsave(&input->slock, flags);
+	if (!input->streaming || list_empty(&input->buffers)) {
+		spin_unlock_irqrestore(&input->slock, flags);
+		mutex_unlock(&input->frame_lock);
+		return;
+	}
+
+	buf = list_first_entry(&input->buffers, struct xemu_buffer, list);
+	list_del(&buf->list);
+	spin_unlock_irqrestore(&input->slock, flags);
+
+	for (i = 0; i < pipe->num_outputs; i++)
+		xemu_complete_frame(&pipe->vcap[i], &buf->vb);
+
+	buf->vb.sequence = input->sequence++;
+	vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+
+	mutex_unlock(&input->frame_lock);
+}
+
+/*
+ * Emit a frame start event, and complete a buffer on each streaming capture
+ * video node, once per frame period, or process an input buffer when the ISP
+ * reads from memory. The frame period is reread at every frame for the
+ * blanking controls to take effect on the next frame.
+ */
+static int xemu_frame_thread(void *data)
+{
+	struct xemu_pipeline *pipe = data;
+	ktime_t next = ktime_get();
+	unsigned int i;
+
+	while (!kthread_should_stop()) {
+		struct v4l2_event event = {
+			.type = V4L2_EVENT_FRAME_SYNC,
+			.u.frame_sync.frame_sequence = pipe->sequence,
+		};
+		struct xemu_video *video;
+
+		if (xemu_pipeline_reprocessing(pipe)) {
+			xemu_process_input(pipe);
+		} else {
+			v4l2_event_queue(pipe->csi2rx.sd.devnode, &event);
+
+			for (i = 0; (video = xemu_video_list(pipe, i)); i++) {
+				if (!V4L2_TYPE_IS_OUTPUT(video->queue.type))
+					xemu_complete_frame(video, NULL);
+			}
+
+			pipe->sequence++;
+		}
+
+		next = ktime_add_ns(next, READ_ONCE(pipe->sensor.frame_period));
+		if (ktime_before(next, ktime_get()))
+			next = ktime_get();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Media graph
+ */
+
+static void xemu_pipeline_cleanup(struct xemu_pipeline *pipe)
+{
+	struct xemu_video *video;
+	unsigned int i;
+
+	media_device_unregister(&pipe->mdev);
+
+	for (i = 0; (video = xemu_video_list(pipe, i)); i++) {
+		video_unregister_device(&video->vdev);
+		media_entity_cleanup(&video->vdev.entity);
+		if (video->queue.ops)
+			vb2_queue_release(&video->queue);
+	}
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		v4l2_device_unregister_subdev(&pipe->vpss[i].sd);
+		media_entity_cleanup(&pipe->vpss[i].sd.entity);
+	}
+
+	v4l2_device_unregister_subdev(&pipe->isp.sd);
+	media_entity_cleanup(&pipe->isp.sd.entity);
+	v4l2_ctrl_handler_free(&pipe->isp.ctrls);
+
+	v4l2_device_unregister_subdev(&pipe->csi2rx.sd);
+	media_entity_cleanup(&pipe->csi2rx.sd.entity);
+
+	v4l2_device_unregister_subdev(&pipe->sensor.sub.sd);
+	media_entity_cleanup(&pipe->sensor.sub.sd.entity);
+	v4l2_ctrl_handler_free(&pipe->sensor.sub.ctrls);
+
+	v4l2_device_unregister(&pipe->v4l2_dev);
+	media_device_cleanup(&pipe->mdev);
+}
+
+static int xemu_pipeline_init(struct xemu_pipeline *pipe)
+{
+	unsigned int csi2rx_base = 0x80050000 + pipe->index * 0x1000;
+	unsigned int isp_base = 0xa0010000 + pipe->index * 0x80000;
+	const char *sensor = xemu_default_sensors[pipe->index];
+	struct xemu_video *video;
+	char name[32];
+	unsigned int i;
+	int ret;
+
+	if (pipe->index < num_sensors && sensors[pipe->index])
+		sensor = sensors[pipe->index];
+
+	pipe->num_outputs = clamp(outputs, 1U, (unsigned int)XEMU_MAX_OUTPUTS);
+	pipe->has_raw = raw_capture;
+	pipe->has_input = input_node;
+	mutex_init(&pipe->lock);
+
+	pipe->mdev.dev = pipe->dev;
+	strscpy(pipe->mdev.model, "Xilinx Video Composite Device",
+		sizeof(pipe->mdev.model));
+	snprintf(pipe->mdev.bus_info, sizeof(pipe->mdev.bus_info),
+		 "platform:%s", dev_name(pipe->dev));
+	media_device_init(&pipe->mdev);
+
+	pipe->v4l2_dev.mdev = &pipe->mdev;
+	ret = v4l2_device_register(pipe->dev, &pipe->v4l2_dev);
+	if (ret) {
+		media_device_cleanup(&pipe->mdev);
+		return ret;
+	}
+
+	ret = xemu_sensor_init(pipe, sensor);
+	if (ret)
+		goto error;
+
+	snprintf(name, sizeof(name), "%08x.mipi_csi2_rx_subsystem", csi2rx_base);
+	ret = xemu_subdev_init(&pipe->csi2rx, XEMU_CSI2RX, name);
+	if (ret)
+		goto error;
+
+	snprintf(name, sizeof(name), "%08x.%s", isp_base,
+		 aie ? "ISPPipeline_aie" : "ISPPipeline_accel");
+	ret = xemu_subdev_init(&pipe->isp, XEMU_ISP, name);
+	if (ret)
+		goto error;
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		snprintf(name, sizeof(name), "%08x.v_proc_ss",
+			 isp_base + 0x30000 + i * 0x10000);
+		ret = xemu_subdev_init(&pipe->vpss[i], XEMU_VPSS, name);
+		if (ret)
+			goto error;
+
+		if (i)
+			snprintf(name, sizeof(name), "vcap_mipi_%u_v_proc_%u output 0",
+				 pipe->index, i);
+		else
+			snprintf(name, sizeof(name), "vcap_mipi_%u_v_proc output 0",
+				 pipe->index);
+		ret = xemu_video_init(pipe, &pipe->vcap[i], name, false, false);
+		if (ret)
+			goto error;
+	}
+
+	if (pipe->has_raw) {
+		snprintf(name, sizeof(name), "vcap_mipi_%u_raw output 0", pipe->index);
+		ret = xemu_video_init(pipe, &pipe->raw, name, true, false);
+		if (ret)
+			goto error;
+	}
+
+	if (pipe->has_input) {
+		snprintf(name, sizeof(name), "vcap_mipi_%u_in input 0", pipe->index);
+		ret = xemu_video_init(pipe, &pipe->input, name, true, true);
+		if (ret)
+			goto error;
+	}
+
+	ret = v4l2_device_register_subdev(&pipe->v4l2_dev, &pipe->sensor.sub.sd);
+	if (!ret)
+		ret = v4l2_device_register_subdev(&pipe->v4l2_dev, &pipe->csi2rx.sd);
+	if (!ret)
+		ret = v4l2_device_register_subdev(&pipe->v4l2_dev, &pipe->isp.sd);
+	for (i = 0; !ret && i < pipe->num_outputs; i++)
+		ret = v4l2_device_register_subdev(&pipe->v4l2_dev, &pipe->vpss[i].sd);
+	if (ret)
+		goto error;
+
+	/*
+	 * As on the hardware, only the sensor to csi2rx link is mutable, and
+	 * the links to the ISP sink when it can also be fed from memory.
+	 */
+	ret = media_create_pad_link(&pipe->sensor.sub.sd.entity, 0,
+				    &pipe->csi2rx.sd.entity, 0,
+				    MEDIA_LNK_FL_ENABLED);
+	if (!ret)
+		ret = media_create_pad_link(&pipe->csi2rx.sd.entity, 1,
+					    &pipe->isp.sd.entity, 0,
+					    MEDIA_LNK_FL_ENABLED |
+					    (pipe->has_input ? 0 : MEDIA_LNK_FL_IMMUTABLE));
+	for (i = 0; !ret && i < pipe->num_outputs; i++) {
+		ret = media_create_pad_link(&pipe->isp.sd.entity, 1,
+					    &pipe->vpss[i].sd.entity, 0,
+					    MEDIA_LNK_FL_ENABLED |
+					    MEDIA_LNK_FL_IMMUTABLE);
+		if (!ret)
+			ret = media_create_pad_link(&pipe->vpss[i].sd.entity, 1,
+						    &pipe->vcap[i].vdev.entity, 0,
+						    MEDIA_LNK_FL_ENABLED |
+						    MEDIA_LNK_FL_IMMUTABLE);
+	}
+	if (!ret && pipe->has_raw)
+		ret = media_create_pad_link(&pipe->csi2rx.sd.entity, 1,
+					    &pipe->raw.vdev.entity, 0,
+					    MEDIA_LNK_FL_ENABLED |
+					    MEDIA_LNK_FL_IMMUTABLE);
+	if (!ret && pipe->has_input) {
+		ret = media_create_pad_link(&pipe->input.vdev.entity, 0,
+					    &pipe->isp.sd.entity, 0, 0);
+		if (!ret)
+			pipe->input_link = media_entity_find_link(&pipe->input.pad,
+								  &pipe->isp.pads[0]);
+	}
+	if (ret)
+		goto error;
+
+	for (i = 0; (video = xemu_video_list(pipe, i)); i++) {
+		ret = video_register_device(&video->vdev, VFL_TYPE_VIDEO, -1);
+		if (ret)
+			goto error;
+	}
+
+	ret = v4l2_device_register_subdev_nodes(&pipe->v4l2_dev);
+	if (ret)
+		goto error;
+
+	ret = media_device_register(&pipe->mdev);
+	if (ret)
+		goto error;
+
+	return 0;
+
+error:
+	xemu_pipeline_cleanup(pipe);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Platform driver
+ */
+
+static struct platform_device *xemu_devices[XEMU_MAX_PIPELINES];
+
+static int xemu_probe(struct platform_device *pdev)
+{
+	struct xemu_pipeline *pipe;
+	int ret;
+
+	pipe = devm_kzalloc(&pdev->dev, sizeof(*pipe), GFP_KERNEL);
+	if (!pipe)
+		return -ENOMEM;
+
+	pipe->dev = &pdev->dev;
+	pipe->index = pdev->id;
+
+	ret = xemu_pipeline_init(pipe);
+	if (ret)
+		return ret;
+
+	platform_set_drvdata(pdev, pipe);
+
+	dev_info(&pdev->dev, "emulated capture pipeline %u, %s, %u outputs%s%s\n",
+		 pipe->index, pipe->sensor.model->name, pipe->num_outputs,
+		 pipe->has_raw ? ", raw" : "", pipe->has_input ? ", input" : "");
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void xemu_remove(struct platform_device *pdev)
+#else
+static int xemu_remove(struct platform_device *pdev)
+#endif
+{
+	struct xemu_pipeline *pipe = platform_get_drvdata(pdev);
+
+	xemu_pipeline_cleanup(pipe);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	return 0;
+#endif
+}
+
+static struct platform_driver xemu_driver = {
+	.probe = xemu_probe,
+	.remove = xemu_remove,
+	.driver = {
+		.name = XEMU_DRIVER_NAME,
+	},
+};
+
+static void xemu_unregister_devices(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(xemu_devices); i++) {
+		if (xemu_devices[i])
+			platform_device_unregister(xemu_devices[i]);
+		xemu_devices[i] = NULL;
+	}
+}
+
+static int __init xemu_init(void)
+{
+	unsigned int count = clamp(pipelines, 1U, (unsigned int)XEMU_MAX_PIPELINES);
+	unsigned int i;
+	int ret;
+
+	ret = platform_driver_register(&xemu_driver);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		xemu_devices[i] = platform_device_register_simple(XEMU_DRIVER_NAME,
+								  i, NULL, 0);
+		if (IS_ERR(xemu_devices[i])) {
+			ret = PTR_ERR(xemu_devices[i]);
+			xemu_devices[i] = NULL;
+			xemu_unregister_devices();
+			platform_driver_unregister(&xemu_driver);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void __exit xemu_exit(void)
+{
+	xemu_unregister_devices();
+	platform_driver_unregister(&xemu_driver);
+}
+
+module_init(xemu_init);
+module_exit(xemu_exit);
+
+MODULE_DESCRIPTION("Emulated xisp capture pipelines");
+MODULE_AUTHOR("Mario Bergeron <Mario.Bergeron@avnet.com>");
+MODULE_LICENSE("GPL");